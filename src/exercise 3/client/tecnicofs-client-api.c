@@ -1,17 +1,95 @@
+#define _GNU_SOURCE
 #include "tecnicofs-client-api.h"
+#include "tecnicofs-protocol.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 
-int sockfd; // client's sockfd
+/* Batch frames sent ahead of their replies */
+#define MAX_BATCHES_IN_FLIGHT 16
+/*
+ * Bytes of batch replies left unread at once: the server stops reading
+ * requests while it cannot send a reply, so they must fit well within
+ * the socket buffer (about 200KiB by default)
+ */
+#define MAX_BATCH_REPLY_BYTES (64 * 1024)
+/* Async requests outstanding at once; older tickets are recycled */
+#define MAX_PENDING 256
 
-char* serverName;
-socklen_t servlen;
-struct sockaddr_un serv_addr;
-char* client_path;
+/* State of a ticket */
+enum { REQ_FREE, REQ_SENT, REQ_DONE };
+
+/* Range of the shared ring used by a request in flight */
+typedef struct shmRange {
+  uint64_t start;
+  uint64_t end; // includes the bytes skipped so the range does not wrap
+  int done;
+} shmRange;
+
+/* Request waiting for its reply, or a result waiting for tfsWait */
+typedef struct pendingRequest {
+  uint32_t id;
+  int state;
+  int waiting;  // threads blocked in tfsWait on it
+  int result;
+  int* results; // where a batch reply stores its results
+  char* data;   // where a read reply stores its bytes
+  uint32_t dataLen;
+  shmRange* range; // range of the shared ring used by the request, or NULL
+  int* fd;      // where the descriptor passed with the reply is stored
+  tfs_callback callback;
+  void* arg;
+} pendingRequest;
+
+/* Operation queued in a batch */
+typedef struct batchOp {
+  uint8_t opcode;
+  char nodeType;
+  char* arg1;
+  char* arg2;
+} batchOp;
+
+/*
+ * A mount: one connection to the server and the requests in flight on
+ * it. Any number of threads may use a session at once. Frames are sent
+ * whole under sendLock; replies are read by whichever waiting thread
+ * takes the reader role, and matched to their tickets under lock.
+ */
+struct tfs_session {
+  int sockfd;
+  int binary; // the server accepted the binary protocol
+  uint32_t nextRequestId;
+
+  pthread_mutex_t lock;
+  pthread_cond_t replied;
+  pthread_mutex_t sendLock;
+  int reading;  // a thread is reading a reply
+  int inFlight; // requests sent and not yet answered
+  pendingRequest pending[MAX_PENDING];
+
+  // ring shared with the server (NULL if not attached); ranges are taken
+  // at shmHead and given back in order at shmTail, both running counters
+  char* shm;
+  uint64_t shmHead, shmTail;
+  shmRange shmRanges[MAX_PENDING];
+  int shmFirst, shmCount;
+
+  // between tfsBatchBegin and tfsBatchSubmit
+  int batching;
+  batchOp* batchOps;
+  int batchSize, batchCapacity;
+};
+
+/* Session of the calls without a session argument */
+tfs_session* defaultSession;
 
 
 int setSockAddrUn(char* path, struct sockaddr_un* addr) {
@@ -26,176 +104,1076 @@ int setSockAddrUn(char* path, struct sockaddr_un* addr) {
   return SUN_LEN(addr);
 }
 
-int setSockAddrUnClient(struct sockaddr_un* addr) {
+/*
+ * Writes or reads exactly len bytes on the connection.
+ * Returns 0, or -1 if the connection failed or was closed.
+ */
+static int sendAll(int sockfd, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(sockfd, buf, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
 
-  if (addr == NULL)
-    return 0;
+static int recvAll(int sockfd, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = recv(sockfd, buf, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
 
-  bzero((char *)addr, sizeof(struct sockaddr_un));
-  addr->sun_family = AF_UNIX;
-  client_path = tmpnam(addr->sun_path);
-  return SUN_LEN(addr);
+/*
+ * Reads the length of the next frame, and the descriptor the server
+ * passed with it, if any (-1 otherwise).
+ * Returns 0, or -1 if the connection failed or was closed.
+ */
+static int recvHeader(int sockfd, uint32_t* len, int* fd) {
+  char* buf = (char *) len;
+  size_t left = FRAME_HEADER_SIZE;
+
+  *fd = -1;
+  while (left > 0) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = buf, .iov_len = left };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+      if (*fd >= 0)
+        close(*fd);
+      memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    buf += n;
+    left -= n;
+  }
+  return 0;
 }
 
+static void lockSession(pthread_mutex_t* lock) {
+  if (pthread_mutex_lock(lock) != 0) {
+    perror("Client: failed to lock session");
+    exit(EXIT_FAILURE);
+  }
+}
 
-int tfsCreate(char* filename, char nodeType) {
-  char command[MAX_INPUT_SIZE], res_str[MAX_INPUT_SIZE];
-  int c;
+static void unlockSession(pthread_mutex_t* lock) {
+  if (pthread_mutex_unlock(lock) != 0) {
+    perror("Client: failed to unlock session");
+    exit(EXIT_FAILURE);
+  }
+}
 
-  if ( sprintf(command, "c %s %c", filename, nodeType) < 0 ) {
-    perror("Client Create: sprintf failed");
+static void signalSession(tfs_session* s) {
+  if (pthread_cond_broadcast(&s->replied) != 0) {
+    perror("Client: failed to signal");
     exit(EXIT_FAILURE);
   }
+}
 
-  // send
-  if (sendto(sockfd, command, strlen(command)+1, 0,
-             (struct sockaddr *) &serv_addr, servlen) < 0) {
-    perror("Client Create: sendto error");
+/*
+ * Sends a frame with the given payload.
+ */
+static void sendFrame(tfs_session* s, char* frame, uint32_t len, char* who) {
+  memcpy(frame, &len, FRAME_HEADER_SIZE);
+  lockSession(&s->sendLock);
+  if (sendAll(s->sockfd, frame, FRAME_HEADER_SIZE + len) < 0) {
+    fprintf(stderr, "Client %s: send error\n", who);
     exit(EXIT_FAILURE);
   }
+  unlockSession(&s->sendLock);
+}
 
-  // receive
-  if ((c = recvfrom(sockfd, res_str, sizeof(res_str)-1, 0, 0,0)) < 0) {
+/*
+ * Sends a text command to the server and waits for its result.
+ * Input:
+ *  - command: text of the command
+ *  - who: name of the caller, for error messages
+ */
+static int sendCommand(tfs_session* s, char* command, char* who) {
+  char frame[FRAME_HEADER_SIZE + MAX_FRAME_SIZE];
+  char res_str[MAX_INPUT_SIZE];
+  uint32_t len = strlen(command);
 
-    perror("Client Create: recvfrom error");
+  if (len > MAX_FRAME_SIZE)
+    return TECNICOFS_ERROR_OTHER;
+  memcpy(frame + FRAME_HEADER_SIZE, command, len);
+  memcpy(frame, &len, FRAME_HEADER_SIZE);
+
+  // text replies carry no id: the whole round trip is done under sendLock
+  lockSession(&s->sendLock);
+  if (sendAll(s->sockfd, frame, FRAME_HEADER_SIZE + len) < 0) {
+    fprintf(stderr, "Client %s: send error\n", who);
     exit(EXIT_FAILURE);
   }
-  res_str[c]='\0';
+  if (recvAll(s->sockfd, (char *) &len, FRAME_HEADER_SIZE) < 0 || len >= sizeof(res_str) ||
+      recvAll(s->sockfd, res_str, len) < 0) {
+    fprintf(stderr, "Client %s: receive error\n", who);
+    exit(EXIT_FAILURE);
+  }
+  unlockSession(&s->sendLock);
+  res_str[len] = '\0';
   return atoi(res_str);
 }
 
-int tfsDelete(char* path) {
-  char command[MAX_INPUT_SIZE], res_str[MAX_INPUT_SIZE];
-  int c;
+/*
+ * Applies an operation with a text command.
+ * Returns: result of the operation
+ */
+static int textRequest(tfs_session* s, uint8_t opcode, char nodeType, char* arg1, char* arg2) {
+  char command[MAX_FRAME_SIZE + 1];
+  int n;
 
-  if ( sprintf(command, "d %s", path) < 0 ) {
-    perror("Client Delete: sprintf failed");
+  switch (opcode) {
+    case OP_CREATE: n = snprintf(command, sizeof(command), "c %s %c", arg1, nodeType); break;
+    case OP_DELETE: n = snprintf(command, sizeof(command), "d %s", arg1); break;
+    case OP_MOVE: n = snprintf(command, sizeof(command), "m %s %s", arg1, arg2); break;
+    case OP_PRINT: n = snprintf(command, sizeof(command), "p %s", arg1); break;
+    default: n = snprintf(command, sizeof(command), "l %s", arg1);
+  }
+  if ( n < 0 ) {
+    perror("Client: sprintf failed");
     exit(EXIT_FAILURE);
   }
+  return sendCommand(s, command, "Text");
+}
 
-  // send
-  if (sendto(sockfd, command, strlen(command)+1, 0,
-             (struct sockaddr *) &serv_addr, servlen) < 0) {
-    perror("Client Delete: sendto error");
-    exit(EXIT_FAILURE);
+/*
+ * Encodes a binary request.
+ * Input:
+ *  - buf: where to write the request
+ *  - room: space left in buf
+ *  - opcode: operation
+ *  - nodeType: node type for OP_CREATE, permission for OP_OPEN
+ *  - arg1, arg2: path arguments (arg2 may be NULL)
+ *  - id: request id
+ * Returns: size of the request, or -1 if it does not fit
+ */
+static int encodeRequest(char* buf, uint32_t room, uint8_t opcode, char nodeType,
+                         char* arg1, char* arg2, uint32_t id) {
+  tfs_request_header header = { .opcode = opcode, .node_type = nodeType,
+                                .num_args = arg2 ? 2 : 1, .request_id = id };
+  char* args[2] = { arg1, arg2 };
+  uint32_t len = sizeof(header);
+
+  if (room < len)
+    return -1;
+  memcpy(buf, &header, sizeof(header));
+  for (int i = 0; i < header.num_args; i++) {
+    size_t arg_len = strlen(args[i]) + 1;
+    if (arg_len > UINT16_MAX || len + ARG_HEADER_SIZE + arg_len > room)
+      return -1;
+    uint16_t l = arg_len;
+    memcpy(buf + len, &l, ARG_HEADER_SIZE);
+    memcpy(buf + len + ARG_HEADER_SIZE, args[i], arg_len);
+    len += ARG_HEADER_SIZE + arg_len;
   }
+  return len;
+}
 
-  // receive
-  if ((c = recvfrom(sockfd, res_str, sizeof(res_str)-1, 0,0,0)) < 0) {
-    perror("Client Delete: recvfrom error");
-    exit(EXIT_FAILURE);
+/*
+ * Gives back a range of the shared ring. Ranges are freed in the order
+ * they were taken. Must be called with the session locked.
+ */
+static void shmRelease(tfs_session* s, shmRange* range) {
+  range->done = 1;
+  while (s->shmCount > 0 && s->shmRanges[s->shmFirst].done) {
+    s->shmTail = s->shmRanges[s->shmFirst].end;
+    s->shmFirst = (s->shmFirst + 1) % MAX_PENDING;
+    s->shmCount--;
   }
-  res_str[c]='\0';
-  return atoi(res_str);
 }
 
-int tfsMove(char* from, char* to) {
-  char command[MAX_INPUT_SIZE], res_str[MAX_INPUT_SIZE];
-  int c;
-  
-  if ( sprintf(command, "m %s %s",from,to) < 0 ) {
-    perror("Client Move: sprintf failed");
-    exit(EXIT_FAILURE);
+/*
+ * Makes progress on the session: reads one reply and completes its
+ * ticket, handing the result to its callback if any. If another thread
+ * is already reading, or nothing is in flight, waits for a change
+ * instead. Must be called with the session locked; the lock is dropped
+ * while reading and while the callback runs.
+ */
+static void progress(tfs_session* s, char* who) {
+  uint32_t len;
+  tfs_reply reply;
+  pendingRequest* req;
+  int fd;
+
+  if (s->reading || s->inFlight == 0) {
+    if (pthread_cond_wait(&s->replied, &s->lock) != 0) {
+      perror("Client: failed to wait");
+      exit(EXIT_FAILURE);
+    }
+    return;
   }
+  s->reading = 1;
+  unlockSession(&s->lock);
 
-  // send
-  if (sendto(sockfd, command, strlen(command)+1, 0,
-             (struct sockaddr *) &serv_addr, servlen) < 0) {
-    perror("Client Move: sendto error");
+  // replies to the requests sent by every thread arrive in send order
+  if (recvHeader(s->sockfd, &len, &fd) < 0 || len < sizeof(reply) ||
+      recvAll(s->sockfd, (char *) &reply, sizeof(reply)) < 0) {
+    fprintf(stderr, "Client %s: receive error\n", who);
     exit(EXIT_FAILURE);
   }
+  // the sender filled in the slot under the lock
+  lockSession(&s->lock);
+  req = &s->pending[reply.request_id % MAX_PENDING];
+  pendingRequest sent = *req;
+  char* ring = sent.range ? s->shm + sent.range->start % SHM_RING_SIZE : NULL;
+  unlockSession(&s->lock);
 
-  // receive
-  if ((c = recvfrom(sockfd, res_str, sizeof(res_str)-1, 0,0,0)) < 0) {
-    perror("Client Move: recvfrom error");
+  uint32_t extra = len - sizeof(reply);
+  if (sent.id != reply.request_id || sent.state != REQ_SENT ||
+      (sent.results ? extra != reply.status * sizeof(int32_t) :
+       sent.data && ring == NULL ?
+         extra != (reply.status > 0 ? reply.status : 0) || extra > sent.dataLen :
+       extra != 0 || (sent.data && reply.status > (int32_t) sent.dataLen))) {
+    fprintf(stderr, "Client %s: unexpected reply\n", who);
     exit(EXIT_FAILURE);
   }
-  res_str[c]='\0';
-  return atoi(res_str);
+  if (sent.data && ring == NULL && recvAll(s->sockfd, sent.data, extra) < 0) {
+    fprintf(stderr, "Client %s: receive error\n", who);
+    exit(EXIT_FAILURE);
+  }
+  if (fd >= 0 && sent.fd == NULL) {
+    close(fd);
+    fd = -1;
+  }
+  // the server read into the ring; the range is ours until released below
+  if (sent.data && ring != NULL && reply.status > 0)
+    memcpy(sent.data, ring, reply.status);
+  for (int i = 0; sent.results && i < reply.status; i++) {
+    int32_t res;
+    if (recvAll(s->sockfd, (char *) &res, sizeof(res)) < 0) {
+      fprintf(stderr, "Client %s: receive error\n", who);
+      exit(EXIT_FAILURE);
+    }
+    sent.results[i] = res;
+  }
+
+  lockSession(&s->lock);
+  tfs_callback callback = req->callback;
+  void* arg = req->arg;
+  if (req->range != NULL)
+    shmRelease(s, req->range);
+  if (req->fd != NULL)
+    *req->fd = fd;
+  s->inFlight--;
+  s->reading = 0;
+  if (callback != NULL)
+    req->state = REQ_FREE;
+  else {
+    req->result = reply.status;
+    req->state = REQ_DONE;
+  }
+  signalSession(s);
+
+  if (callback != NULL) {
+    unlockSession(&s->lock);
+    callback(reply.request_id, reply.status, arg);
+    lockSession(&s->lock);
+  }
 }
 
-int tfsPrint(char* outputfile) {
-  char command[MAX_INPUT_SIZE], res_str[MAX_INPUT_SIZE];
-  int c;
-  
-  if ( sprintf(command, "p %s", outputfile) < 0 ) {
-    perror("Client Print: sprintf failed");
-    exit(EXIT_FAILURE);
+/*
+ * Takes the next ticket. Must be called with the session locked.
+ * Returns: the ticket's slot
+ */
+static pendingRequest* takeTicket(tfs_session* s, char* who) {
+  uint32_t id = s->nextRequestId++ & INT32_MAX;
+  pendingRequest* req = &s->pending[id % MAX_PENDING];
+
+  // the slot is still taken by a request MAX_PENDING tickets ago
+  while (req->state == REQ_SENT || req->waiting)
+    progress(s, who);
+  req->id = id;
+  return req;
+}
+
+/*
+ * Takes a ticket for a request about to be sent.
+ * Input:
+ *  - fill: what to do with the reply (may be NULL): callback and arg,
+ *    the completion callback and its argument; results, where a batch
+ *    reply stores its results; data and dataLen, where a read reply
+ *    stores its bytes; range, the part of the shared ring the request
+ *    uses; fd, where a descriptor passed with the reply is stored
+ * Returns: the ticket
+ */
+static uint32_t sendTicket(tfs_session* s, pendingRequest* fill, char* who) {
+  lockSession(&s->lock);
+  pendingRequest* req = takeTicket(s, who);
+  req->state = REQ_SENT;
+  req->results = fill ? fill->results : NULL;
+  req->data = fill ? fill->data : NULL;
+  req->dataLen = fill ? fill->dataLen : 0;
+  req->range = fill ? fill->range : NULL;
+  req->fd = fill ? fill->fd : NULL;
+  req->callback = fill ? fill->callback : NULL;
+  req->arg = fill ? fill->arg : NULL;
+  s->inFlight++;
+  unlockSession(&s->lock);
+  return req->id;
+}
+
+/*
+ * Gives back a ticket whose request could not be sent.
+ */
+static void dropTicket(tfs_session* s, uint32_t ticket) {
+  lockSession(&s->lock);
+  s->pending[ticket % MAX_PENDING].state = REQ_FREE;
+  s->inFlight--;
+  signalSession(s);
+  unlockSession(&s->lock);
+}
+
+/*
+ * Sends a request without waiting for its result. Against a text-only
+ * server the request is applied synchronously and completes at once.
+ * Input:
+ *  - opcode: operation
+ *  - nodeType: node type for OP_CREATE, permission for OP_OPEN
+ *  - arg1, arg2: path arguments (arg2 may be NULL)
+ *  - callback, arg: completion callback and its argument (may be NULL)
+ *  - who: name of the caller, for error messages
+ * Returns: ticket of the request, or an error
+ */
+static int issueRequest(tfs_session* s, uint8_t opcode, char nodeType, char* arg1, char* arg2,
+                        tfs_callback callback, void* arg, char* who) {
+  char frame[FRAME_HEADER_SIZE + MAX_FRAME_SIZE];
+  uint32_t ticket;
+  int len;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  if (!s->binary) {
+    int result = textRequest(s, opcode, nodeType, arg1, arg2);
+    lockSession(&s->lock);
+    pendingRequest* req = takeTicket(s, who);
+    req->state = callback ? REQ_FREE : REQ_DONE;
+    req->result = result;
+    ticket = req->id;
+    unlockSession(&s->lock);
+    if (callback != NULL)
+      callback(ticket, result, arg);
+    return ticket;
   }
 
-  // send
-  if (sendto(sockfd, command, strlen(command)+1, 0,
-             (struct sockaddr *) &serv_addr, servlen) < 0) {
-    perror("Client Print: sendto error");
-    exit(EXIT_FAILURE);
+  ticket = sendTicket(s, &(pendingRequest) { .callback = callback, .arg = arg }, who);
+  if ((len = encodeRequest(frame + FRAME_HEADER_SIZE, MAX_FRAME_SIZE,
+                           opcode, nodeType, arg1, arg2, ticket)) < 0) {
+    dropTicket(s, ticket);
+    return TECNICOFS_ERROR_OTHER;
   }
+  sendFrame(s, frame, len, who);
+  return ticket;
+}
 
-  // receive
-  if ((c = recvfrom(sockfd, res_str, sizeof(res_str)-1, 0, 0, 0)) < 0) {
-    perror("Client Print: recvfrom error");
-    exit(EXIT_FAILURE);
+/*
+ * Waits for the result of a ticket.
+ * Returns: 0, or an error if the ticket is unknown or already delivered
+ */
+static int waitTicket(tfs_session* s, int ticket, int* result, char* who) {
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (ticket < 0)
+    return TECNICOFS_ERROR_OTHER;
+
+  pendingRequest* req = &s->pending[ticket % MAX_PENDING];
+  int res = TECNICOFS_ERROR_OTHER;
+
+  lockSession(&s->lock);
+  if (req->id == (uint32_t) ticket) {
+    req->waiting++;
+    while (req->state == REQ_SENT)
+      progress(s, who);
+    req->waiting--;
+    if (req->state == REQ_DONE) {
+      req->state = REQ_FREE;
+      if (result != NULL)
+        *result = req->result;
+      res = 0;
+    }
+    // a thread may be waiting to reuse the slot
+    signalSession(s);
   }
-  res_str[c]='\0';
-  return atoi(res_str);
+  unlockSession(&s->lock);
+  return res;
 }
 
-int tfsLookup(char* path) {
-  char command[MAX_INPUT_SIZE], res_str[MAX_INPUT_SIZE];
-  int c;
-  
-  if ( sprintf(command, "l %s",path) < 0 ) {
-    perror("Client Lookup: sprintf failed");
-    exit(EXIT_FAILURE);
+/*
+ * Sends a request to the server and waits for its result.
+ * Input:
+ *  - opcode: operation
+ *  - nodeType: node type for OP_CREATE, permission for OP_OPEN
+ *  - arg1, arg2: path arguments (arg2 may be NULL)
+ *  - who: name of the caller, for error messages
+ */
+static int sendRequest(tfs_session* s, uint8_t opcode, char nodeType, char* arg1, char* arg2,
+                       char* who) {
+  int ticket, result;
+
+  if ((ticket = issueRequest(s, opcode, nodeType, arg1, arg2, NULL, NULL, who)) < 0)
+    return ticket;
+  waitTicket(s, ticket, &result, who);
+  return result;
+}
+
+
+int tfsSessionCreate(tfs_session* s, char* filename, char nodeType) {
+  return sendRequest(s, OP_CREATE, nodeType, filename, NULL, "Create");
+}
+
+int tfsSessionDelete(tfs_session* s, char* path) {
+  return sendRequest(s, OP_DELETE, 0, path, NULL, "Delete");
+}
+
+int tfsSessionMove(tfs_session* s, char* from, char* to) {
+  return sendRequest(s, OP_MOVE, 0, from, to, "Move");
+}
+
+int tfsSessionPrint(tfs_session* s, char* outputfile) {
+  return sendRequest(s, OP_PRINT, 0, outputfile, NULL, "Print");
+}
+
+int tfsSessionLookup(tfs_session* s, char* path) {
+  return sendRequest(s, OP_LOOKUP, 0, path, NULL, "Lookup");
+}
+
+/*
+ * Adds an operation to the session's current batch.
+ * Returns: index of its result in the batch, or an error
+ */
+static int batchQueue(tfs_session* s, uint8_t opcode, char nodeType, char* arg1, char* arg2) {
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (!s->batching)
+    return TECNICOFS_ERROR_OTHER;
+
+  if (s->batchSize == s->batchCapacity) {
+    int capacity = s->batchCapacity ? s->batchCapacity * 2 : 64;
+    batchOp* ops = realloc(s->batchOps, capacity * sizeof(batchOp));
+    if (ops == NULL)
+      return TECNICOFS_ERROR_OTHER;
+    s->batchOps = ops;
+    s->batchCapacity = capacity;
   }
 
-  // send
-  if (sendto(sockfd, command, strlen(command)+1, 0,
-             (struct sockaddr *) &serv_addr, servlen) < 0) {
-    perror("Client Lookup: sendto error");
-    exit(EXIT_FAILURE);
+  batchOp* op = &s->batchOps[s->batchSize];
+  op->opcode = opcode;
+  op->nodeType = nodeType;
+  op->arg1 = strdup(arg1);
+  op->arg2 = arg2 ? strdup(arg2) : NULL;
+  if (op->arg1 == NULL || (arg2 && op->arg2 == NULL)) {
+    free(op->arg1);
+    free(op->arg2);
+    return TECNICOFS_ERROR_OTHER;
+  }
+  return s->batchSize++;
+}
+
+/*
+ * Forgets the operations of the session's current batch.
+ */
+static void batchClear(tfs_session* s) {
+  for (int i = 0; i < s->batchSize; i++) {
+    free(s->batchOps[i].arg1);
+    free(s->batchOps[i].arg2);
+  }
+  s->batchSize = 0;
+}
+
+int tfsSessionBatchBegin(tfs_session* s) {
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  batchClear(s);
+  s->batching = 1;
+  return 0;
+}
+
+int tfsSessionBatchCreate(tfs_session* s, char* filename, char nodeType) {
+  return batchQueue(s, OP_CREATE, nodeType, filename, NULL);
+}
+
+int tfsSessionBatchDelete(tfs_session* s, char* path) {
+  return batchQueue(s, OP_DELETE, 0, path, NULL);
+}
+
+int tfsSessionBatchMove(tfs_session* s, char* from, char* to) {
+  return batchQueue(s, OP_MOVE, 0, from, to);
+}
+
+int tfsSessionBatchLookup(tfs_session* s, char* path) {
+  return batchQueue(s, OP_LOOKUP, 0, path, NULL);
+}
+
+/*
+ * Sends the queued operations and collects their results, in order.
+ * The operations are packed into as few batch frames as possible, which
+ * are pipelined: at most MAX_BATCHES_IN_FLIGHT are sent ahead of their
+ * replies, and only while their replies add up to MAX_BATCH_REPLY_BYTES.
+ * A frame's reply is then never stuck in the socket while the client is
+ * blocked sending the next frame.
+ * Input:
+ *  - results: room for one result per queued operation
+ * Returns: number of operations, or an error
+ */
+int tfsSessionBatchSubmit(tfs_session* s, int* results) {
+  char frame[FRAME_HEADER_SIZE + MAX_FRAME_SIZE];
+  int tickets[MAX_BATCHES_IN_FLIGHT];
+  uint32_t replies[MAX_BATCHES_IN_FLIGHT], unread = 0;
+  int sent = 0, frames = 0, done = 0, res = 0;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (!s->batching)
+    return TECNICOFS_ERROR_OTHER;
+  s->batching = 0;
+
+  if (!s->binary) {
+    // the server only knows text commands: one round trip per operation
+    for (int i = 0; i < s->batchSize; i++)
+      results[i] = textRequest(s, s->batchOps[i].opcode, s->batchOps[i].nodeType,
+                               s->batchOps[i].arg1, s->batchOps[i].arg2);
+    res = s->batchSize;
+    batchClear(s);
+    return res;
+  }
+
+  while (sent < s->batchSize) {
+    tfs_request_header header = { .opcode = OP_BATCH, .num_args = 0 };
+    uint32_t len = sizeof(header);
+    int first = sent, n;
+
+    while (sent < s->batchSize && header.num_args < MAX_BATCH_OPS) {
+      batchOp* op = &s->batchOps[sent];
+      if ((n = encodeRequest(frame + FRAME_HEADER_SIZE + len, MAX_FRAME_SIZE - len,
+                             op->opcode, op->nodeType, op->arg1, op->arg2, 0)) < 0)
+        break;
+      len += n;
+      header.num_args++;
+      sent++;
+    }
+    if (header.num_args == 0) {
+      // a single operation larger than a frame
+      res = TECNICOFS_ERROR_OTHER;
+      break;
+    }
+
+    // collect the oldest replies until this one fits
+    uint32_t reply = sizeof(tfs_reply) + header.num_args * sizeof(int32_t);
+    while (done < frames &&
+           (frames - done == MAX_BATCHES_IN_FLIGHT || unread + reply > MAX_BATCH_REPLY_BYTES)) {
+      if (waitTicket(s, tickets[done % MAX_BATCHES_IN_FLIGHT], NULL, "Batch") < 0)
+        res = TECNICOFS_ERROR_OTHER;
+      unread -= replies[done++ % MAX_BATCHES_IN_FLIGHT];
+    }
+    if (res < 0)
+      break;
+    header.request_id = sendTicket(s, &(pendingRequest) { .results = results + first }, "Batch");
+    tickets[frames % MAX_BATCHES_IN_FLIGHT] = header.request_id;
+    replies[frames++ % MAX_BATCHES_IN_FLIGHT] = reply;
+    unread += reply;
+    memcpy(frame + FRAME_HEADER_SIZE, &header, sizeof(header));
+    sendFrame(s, frame, len, "Batch");
+  }
+
+  for (; done < frames; done++)
+    if (waitTicket(s, tickets[done % MAX_BATCHES_IN_FLIGHT], NULL, "Batch") < 0)
+      res = TECNICOFS_ERROR_OTHER;
+
+  if (res == 0)
+    res = s->batchSize;
+  batchClear(s);
+  return res;
+}
+
+int tfsSessionOpen(tfs_session* s, char* path, permission mode) {
+  // descriptors only exist in the binary protocol
+  if (s != NULL && !s->binary)
+    return TECNICOFS_ERROR_OTHER;
+  return sendRequest(s, OP_OPEN, mode, path, NULL, "Open");
+}
+
+/*
+ * Takes a range of the shared ring, waiting for replies to free room.
+ * Input:
+ *  - len: size of the range, at most MAX_IO_SIZE
+ *  - offset: filled with the position of the range in the ring
+ * Returns: the range, for sendTicket
+ */
+static shmRange* shmReserve(tfs_session* s, uint32_t len, uint32_t* offset, char* who) {
+  lockSession(&s->lock);
+  while (1) {
+    uint64_t start = s->shmHead;
+    // a range does not wrap around the end of the ring
+    if (start % SHM_RING_SIZE + len > SHM_RING_SIZE)
+      start += SHM_RING_SIZE - start % SHM_RING_SIZE;
+    if (start + len - s->shmTail <= SHM_RING_SIZE && s->shmCount < MAX_PENDING) {
+      shmRange* range = &s->shmRanges[(s->shmFirst + s->shmCount++) % MAX_PENDING];
+      range->start = start;
+      range->end = start + len;
+      range->done = 0;
+      s->shmHead = start + len;
+      *offset = start % SHM_RING_SIZE;
+      unlockSession(&s->lock);
+      return range;
+    }
+    progress(s, who);
+  }
+}
+
+/*
+ * Applies a file command in chunks of MAX_IO_SIZE bytes. The chunks are
+ * pipelined, at most MAX_BATCHES_IN_FLIGHT ahead of their replies. With
+ * a shared ring, the data is copied once into the ring instead of going
+ * through the socket.
+ * Input:
+ *  - opcode: OP_READ, OP_WRITE or OP_APPEND
+ *  - handle: handle returned by tfsOpen
+ *  - buffer, len: bytes to write, or where to store the bytes read
+ *  - offset: position of the first byte (ignored by OP_APPEND)
+ * Returns: number of bytes read or written, or an error
+ */
+static int fileRequest(tfs_session* s, uint8_t opcode, int handle, char* buffer, int len,
+                       long offset, char* who) {
+  char frame[FRAME_HEADER_SIZE + MAX_FRAME_SIZE];
+  int tickets[MAX_BATCHES_IN_FLIGHT];
+  int chunks = (len + MAX_IO_SIZE - 1) / MAX_IO_SIZE, total = 0, res;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  // file commands only exist in the binary protocol
+  if (!s->binary || len < 0 || offset < 0)
+    return TECNICOFS_ERROR_OTHER;
+
+  for (int i = 0; i < chunks + MAX_BATCHES_IN_FLIGHT; i++) {
+    // collect the reply of the chunk sent MAX_BATCHES_IN_FLIGHT ago
+    if (i >= MAX_BATCHES_IN_FLIGHT && i - MAX_BATCHES_IN_FLIGHT < chunks) {
+      if (waitTicket(s, tickets[i % MAX_BATCHES_IN_FLIGHT], &res, who) < 0)
+        res = TECNICOFS_ERROR_OTHER;
+      if (total >= 0)
+        total = res < 0 ? res : total + res;
+    }
+    if (i >= chunks)
+      continue;
+
+    uint32_t length = len - i * MAX_IO_SIZE < MAX_IO_SIZE ? len - i * MAX_IO_SIZE : MAX_IO_SIZE;
+    char* chunk = buffer + (long) i * MAX_IO_SIZE;
+    tfs_io_request req = { .header = { .opcode = opcode, .num_args = 0 }, .handle = handle,
+                           .length = length, .offset = offset + (long) i * MAX_IO_SIZE };
+    uint32_t frameLen = sizeof(req);
+    pendingRequest fill = { .data = opcode == OP_READ ? chunk : NULL, .dataLen = length };
+
+    if (s->shm != NULL) {
+      fill.range = shmReserve(s, length, &req.shm_offset, who);
+      req.flags = TFS_IO_SHM;
+      if (opcode != OP_READ)
+        memcpy(s->shm + req.shm_offset, chunk, length);
+    }
+    else if (opcode != OP_READ) {
+      memcpy(frame + FRAME_HEADER_SIZE + sizeof(req), chunk, length);
+      frameLen += length;
+    }
+
+    req.header.request_id = sendTicket(s, &fill, who);
+    tickets[i % MAX_BATCHES_IN_FLIGHT] = req.header.request_id;
+    memcpy(frame + FRAME_HEADER_SIZE, &req, sizeof(req));
+    sendFrame(s, frame, frameLen, who);
+  }
+  return total;
+}
+
+int tfsSessionRead(tfs_session* s, int handle, char* buffer, int len, long offset) {
+  return fileRequest(s, OP_READ, handle, buffer, len, offset, "Read");
+}
+
+int tfsSessionWrite(tfs_session* s, int handle, char* buffer, int len, long offset) {
+  return fileRequest(s, OP_WRITE, handle, buffer, len, offset, "Write");
+}
+
+int tfsSessionAppend(tfs_session* s, int handle, char* buffer, int len) {
+  return fileRequest(s, OP_APPEND, handle, buffer, len, 0, "Append");
+}
+
+/*
+ * Applies a file command that carries no data.
+ * Input:
+ *  - opcode: OP_TRUNCATE, OP_CLOSE or OP_MAP_READ
+ *  - handle: handle returned by tfsOpen
+ *  - length: bytes to read, for OP_MAP_READ
+ *  - offset: new size for OP_TRUNCATE, position for OP_MAP_READ
+ *  - fill: what to do with the reply (may be NULL), see sendTicket
+ * Returns: result of the command
+ */
+static int handleRequest(tfs_session* s, uint8_t opcode, int handle, uint32_t length, long offset,
+                         pendingRequest* fill, char* who) {
+  char frame[FRAME_HEADER_SIZE + sizeof(tfs_io_request)];
+  int result;
+
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+  if (!s->binary || offset < 0)
+    return TECNICOFS_ERROR_OTHER;
+
+  tfs_io_request req = { .header = { .opcode = opcode, .num_args = 0 },
+                         .handle = handle, .length = length, .offset = offset };
+  req.header.request_id = sendTicket(s, fill, who);
+  memcpy(frame + FRAME_HEADER_SIZE, &req, sizeof(req));
+  sendFrame(s, frame, sizeof(req), who);
+  if (waitTicket(s, req.header.request_id, &result, who) < 0)
+    return TECNICOFS_ERROR_OTHER;
+  return result;
+}
+
+int tfsSessionTruncate(tfs_session* s, int handle, long size) {
+  return handleRequest(s, OP_TRUNCATE, handle, 0, size, NULL, "Truncate");
+}
+
+int tfsSessionClose(tfs_session* s, int handle) {
+  return handleRequest(s, OP_CLOSE, handle, 0, 0, NULL, "Close");
+}
+
+int tfsSessionMapRead(tfs_session* s, int handle, char** data, int len, long offset) {
+  int result, fd = -1;
+  void* map;
+
+  *data = NULL;
+  if (len < 0 || len > MAX_MAP_SIZE)
+    return TECNICOFS_ERROR_OTHER;
+  // the server passes the bytes read in a sealed memfd
+  result = handleRequest(s, OP_MAP_READ, handle, len, offset,
+                         &(pendingRequest) { .fd = &fd }, "MapRead");
+  if (result <= 0) {
+    if (fd >= 0)
+      close(fd);
+    return result;
   }
+  if (fd < 0)
+    return TECNICOFS_ERROR_OTHER;
+  map = mmap(NULL, result, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return TECNICOFS_ERROR_OTHER;
+  *data = map;
+  return result;
+}
 
-  // receive
-  if ((c = recvfrom(sockfd, res_str, sizeof(res_str)-1, 0,0,0)) < 0) {
-    perror("Client Lookup: recvfrom error");
+int tfsUnmapRead(char* data, int len) {
+  if (data != NULL && munmap(data, len) < 0)
+    return TECNICOFS_ERROR_OTHER;
+  return 0;
+}
+
+int tfsSessionCreateAsync(tfs_session* s, char* filename, char nodeType,
+                          tfs_callback callback, void* arg) {
+  return issueRequest(s, OP_CREATE, nodeType, filename, NULL, callback, arg, "Create");
+}
+
+int tfsSessionDeleteAsync(tfs_session* s, char* path, tfs_callback callback, void* arg) {
+  return issueRequest(s, OP_DELETE, 0, path, NULL, callback, arg, "Delete");
+}
+
+int tfsSessionLookupAsync(tfs_session* s, char* path, tfs_callback callback, void* arg) {
+  return issueRequest(s, OP_LOOKUP, 0, path, NULL, callback, arg, "Lookup");
+}
+
+int tfsSessionMoveAsync(tfs_session* s, char* from, char* to, tfs_callback callback, void* arg) {
+  return issueRequest(s, OP_MOVE, 0, from, to, callback, arg, "Move");
+}
+
+int tfsSessionPrintAsync(tfs_session* s, char* outputfile, tfs_callback callback, void* arg) {
+  return issueRequest(s, OP_PRINT, 0, outputfile, NULL, callback, arg, "Print");
+}
+
+/*
+ * Handles every reply that already arrived, without blocking.
+ * Returns: number of requests still outstanding
+ */
+int tfsSessionPoll(tfs_session* s) {
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  struct pollfd pfd = { .fd = s->sockfd, .events = POLLIN };
+  int inFlight;
+
+  lockSession(&s->lock);
+  // the server writes each reply whole, so a readable socket holds one
+  while (s->inFlight > 0 && !s->reading && poll(&pfd, 1, 0) > 0)
+    progress(s, "Poll");
+  inFlight = s->inFlight;
+  unlockSession(&s->lock);
+  return inFlight;
+}
+
+int tfsSessionWait(tfs_session* s, int ticket, int* result) {
+  return waitTicket(s, ticket, result, "Wait");
+}
+
+int tfsSessionWaitAll(tfs_session* s) {
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  lockSession(&s->lock);
+  while (s->inFlight > 0)
+    progress(s, "Wait");
+  unlockSession(&s->lock);
+  return 0;
+}
+
+/*
+ * Sets up the shared ring: creates it, passes it to the server with an
+ * OP_ATTACH request and keeps it if the server maps it. Without a ring,
+ * file data goes through the socket.
+ */
+static void shmAttach(tfs_session* s) {
+  char frame[FRAME_HEADER_SIZE + sizeof(tfs_request_header)];
+  char control[CMSG_SPACE(sizeof(int))];
+  tfs_request_header header = { .opcode = OP_ATTACH, .num_args = 0 };
+  uint32_t len = sizeof(header);
+  int fd, result;
+  void* shm;
+
+  if ((fd = memfd_create("tecnicofs-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+    return;
+  // the server only maps a ring that cannot shrink under it
+  if (ftruncate(fd, SHM_RING_SIZE) < 0 ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+      (shm = mmap(NULL, SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+
+  header.request_id = sendTicket(s, NULL, "Mount");
+  memcpy(frame, &len, FRAME_HEADER_SIZE);
+  memcpy(frame + FRAME_HEADER_SIZE, &header, sizeof(header));
+
+  struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  lockSession(&s->sendLock);
+  if (sendmsg(s->sockfd, &msg, MSG_NOSIGNAL) != sizeof(frame)) {
+    fprintf(stderr, "Client Mount: send error\n");
     exit(EXIT_FAILURE);
   }
-  res_str[c]='\0';
-  return atoi(res_str);
+  unlockSession(&s->sendLock);
+  close(fd);
+
+  if (waitTicket(s, header.request_id, &result, "Mount") == 0 && result == 0)
+    s->shm = shm;
+  else
+    munmap(shm, SHM_RING_SIZE);
 }
 
-int tfsMount(char* sockPath) {
-  
-  socklen_t clilen;
-  struct sockaddr_un client_addr;
+tfs_session* tfsSessionMount(char* sockPath) {
+  return tfsSessionMountWith(sockPath, 0);
+}
+
+tfs_session* tfsSessionMountWith(char* sockPath, int flags) {
+  struct sockaddr_un serv_addr;
+  socklen_t servlen;
+  tfs_session* s = calloc(1, sizeof(tfs_session));
+
+  if (s == NULL)
+    return NULL;
 
   // create client's socket
-  if ( (sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0 ) {
+  if ( (s->sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
     perror("Client: can't open socket");
     exit(EXIT_FAILURE);
   }
 
-  // clean client's attributes and reset them
-  unlink(client_path);
-  clilen = setSockAddrUnClient(&client_addr);
+  // take care of server's socket attributes
+  servlen = setSockAddrUn(sockPath, &serv_addr);
+
+  // the connection is kept for the whole session
+  if ( connect(s->sockfd, (struct sockaddr *) &serv_addr, servlen) < 0 ) {
+    perror("Client: can't connect to server");
+    close(s->sockfd);
+    free(s);
+    return NULL;
+  }
 
-  // bind
-  if ( bind(sockfd, (struct sockaddr *) &client_addr, clilen) < 0 ) {
-    perror("Client: bind error");
+  if (pthread_mutex_init(&s->lock, NULL) != 0 || pthread_mutex_init(&s->sendLock, NULL) != 0 ||
+      pthread_cond_init(&s->replied, NULL) != 0) {
+    perror("Client: failed to initialize session");
     exit(EXIT_FAILURE);
   }
 
-  // take care of server's socket attributes
-  strcpy(serverName,sockPath);
-  servlen = setSockAddrUn(sockPath, &serv_addr);
-  return 0;
+  // ask for the binary protocol; an older server keeps the session in text
+  if (!(flags & TFS_MOUNT_TEXT)) {
+    char command[MAX_INPUT_SIZE];
+    sprintf(command, "%c %d", TFS_NEGOTIATE_COMMAND, TFS_PROTOCOL_VERSION);
+    s->binary = sendCommand(s, command, "Mount") == TFS_PROTOCOL_VERSION;
+  }
+  if (s->binary && !(flags & TFS_MOUNT_NO_SHM))
+    shmAttach(s);
+  return s;
 }
 
-int tfsUnmount() {
-  if (close(sockfd) < 0)
+int tfsSessionUnmount(tfs_session* s) {
+  if (s == NULL)
+    return TECNICOFS_ERROR_NO_OPEN_SESSION;
+
+  tfsSessionWaitAll(s);
+  if (close(s->sockfd) < 0)
   {
     perror("Client: couldn't close socket");
     exit(EXIT_FAILURE);
   }
+  if (s->shm != NULL)
+    munmap(s->shm, SHM_RING_SIZE);
+  batchClear(s);
+  free(s->batchOps);
+  pthread_mutex_destroy(&s->lock);
+  pthread_mutex_destroy(&s->sendLock);
+  pthread_cond_destroy(&s->replied);
+  free(s);
   return 0;
 }
+
+
+int tfsCreate(char* filename, char nodeType) {
+  return tfsSessionCreate(defaultSession, filename, nodeType);
+}
+
+int tfsDelete(char* path) {
+  return tfsSessionDelete(defaultSession, path);
+}
+
+int tfsMove(char* from, char* to) {
+  return tfsSessionMove(defaultSession, from, to);
+}
+
+int tfsPrint(char* outputfile) {
+  return tfsSessionPrint(defaultSession, outputfile);
+}
+
+int tfsLookup(char* path) {
+  return tfsSessionLookup(defaultSession, path);
+}
+
+int tfsBatchBegin() {
+  return tfsSessionBatchBegin(defaultSession);
+}
+
+int tfsBatchCreate(char* filename, char nodeType) {
+  return tfsSessionBatchCreate(defaultSession, filename, nodeType);
+}
+
+int tfsBatchDelete(char* path) {
+  return tfsSessionBatchDelete(defaultSession, path);
+}
+
+int tfsBatchMove(char* from, char* to) {
+  return tfsSessionBatchMove(defaultSession, from, to);
+}
+
+int tfsBatchLookup(char* path) {
+  return tfsSessionBatchLookup(defaultSession, path);
+}
+
+int tfsBatchSubmit(int* results) {
+  return tfsSessionBatchSubmit(defaultSession, results);
+}
+
+int tfsOpen(char* path, permission mode) {
+  return tfsSessionOpen(defaultSession, path, mode);
+}
+
+int tfsClose(int handle) {
+  return tfsSessionClose(defaultSession, handle);
+}
+
+int tfsMapRead(int handle, char** data, int len, long offset) {
+  return tfsSessionMapRead(defaultSession, handle, data, len, offset);
+}
+
+int tfsRead(int handle, char* buffer, int len, long offset) {
+  return tfsSessionRead(defaultSession, handle, buffer, len, offset);
+}
+
+int tfsWrite(int handle, char* buffer, int len, long offset) {
+  return tfsSessionWrite(defaultSession, handle, buffer, len, offset);
+}
+
+int tfsAppend(int handle, char* buffer, int len) {
+  return tfsSessionAppend(defaultSession, handle, buffer, len);
+}
+
+int tfsTruncate(int handle, long size) {
+  return tfsSessionTruncate(defaultSession, handle, size);
+}
+
+int tfsCreateAsync(char* filename, char nodeType, tfs_callback callback, void* arg) {
+  return tfsSessionCreateAsync(defaultSession, filename, nodeType, callback, arg);
+}
+
+int tfsDeleteAsync(char* path, tfs_callback callback, void* arg) {
+  return tfsSessionDeleteAsync(defaultSession, path, callback, arg);
+}
+
+int tfsLookupAsync(char* path, tfs_callback callback, void* arg) {
+  return tfsSessionLookupAsync(defaultSession, path, callback, arg);
+}
+
+int tfsMoveAsync(char* from, char* to, tfs_callback callback, void* arg) {
+  return tfsSessionMoveAsync(defaultSession, from, to, callback, arg);
+}
+
+int tfsPrintAsync(char* outputfile, tfs_callback callback, void* arg) {
+  return tfsSessionPrintAsync(defaultSession, outputfile, callback, arg);
+}
+
+int tfsPoll() {
+  return tfsSessionPoll(defaultSession);
+}
+
+int tfsWait(int ticket, int* result) {
+  return tfsSessionWait(defaultSession, ticket, result);
+}
+
+int tfsWaitAll() {
+  return tfsSessionWaitAll(defaultSession);
+}
+
+int tfsMount(char* sockPath) {
+  return tfsMountWith(sockPath, 0);
+}
+
+int tfsMountWith(char* sockPath, int flags) {
+  if (defaultSession != NULL)
+    return TECNICOFS_ERROR_OPEN_SESSION;
+
+  if ((defaultSession = tfsSessionMountWith(sockPath, flags)) == NULL)
+    return TECNICOFS_ERROR_CONNECTION_ERROR;
+  return 0;
+}
+
+int tfsUnmount() {
+  int res = tfsSessionUnmount(defaultSession);
+  defaultSession = NULL;
+  return res;
+}
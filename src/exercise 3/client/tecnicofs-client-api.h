@@ -3,12 +3,119 @@
 
 #include "tecnicofs-api-constants.h"
 
+/*
+ * A connection to a TecnicoFS server. A process may mount many sessions,
+ * and any number of threads may share one: each request gets its own
+ * reply. The calls without a session argument use a default session,
+ * opened by tfsMount.
+ */
+typedef struct tfs_session tfs_session;
+
 int tfsCreate(char *path, char nodeType);
 int tfsDelete(char *path);
 int tfsLookup(char *path);
 int tfsMove(char *from, char *to);
 int tfsPrint(char *outputfile);
 int tfsMount(char* serverName);
+
+/*
+ * Mount options, for tfsMountWith: TFS_MOUNT_TEXT keeps the session in
+ * the text protocol, as with a server that only knows it (file commands
+ * are then unavailable); TFS_MOUNT_NO_SHM sends file data through the
+ * socket instead of the shared ring.
+ */
+#define TFS_MOUNT_TEXT 1
+#define TFS_MOUNT_NO_SHM 2
+
+int tfsMountWith(char* serverName, int flags);
+
+/*
+ * Files: tfsOpen returns a handle for the other calls, valid until
+ * tfsClose or tfsUnmount; at most MAX_OPEN_FILES are open per session,
+ * and an open file cannot be deleted. Reads and writes of any size are
+ * split in MAX_IO_SIZE requests; a large write or append is not atomic
+ * with respect to other clients. They return the number of bytes read
+ * or written.
+ */
+int tfsOpen(char *path, permission mode);
+int tfsClose(int handle);
+int tfsRead(int handle, char *buffer, int len, long offset);
+int tfsWrite(int handle, char *buffer, int len, long offset);
+int tfsAppend(int handle, char *buffer, int len);
+int tfsTruncate(int handle, long size);
+
+/*
+ * Large reads without copies: tfsMapRead maps up to len bytes of the file
+ * read by the server, handing the mapping in *data (NULL if nothing was
+ * read), and returns the number of bytes mapped. The mapping is read-only
+ * and stays valid until tfsUnmapRead, whatever happens to the file.
+ * Worth it for reads of a few MiB or more.
+ */
+int tfsMapRead(int handle, char **data, int len, long offset);
+int tfsUnmapRead(char *data, int len);
+
+/*
+ * Batches: the operations queued between tfsBatchBegin and
+ * tfsBatchSubmit are sent together and applied back to back by the
+ * server. Each tfsBatch* call returns the index of its result in the
+ * array filled by tfsBatchSubmit. A session has one batch at a time.
+ */
+int tfsBatchBegin();
+int tfsBatchCreate(char *path, char nodeType);
+int tfsBatchDelete(char *path);
+int tfsBatchLookup(char *path);
+int tfsBatchMove(char *from, char *to);
+int tfsBatchSubmit(int *results);
+
+/*
+ * Asynchronous calls: each returns at once with a ticket, and many
+ * requests may be outstanding. A request's result is handed to its
+ * callback, if any, or else kept until tfsWait asks for it. Callbacks
+ * run in a thread using the session, from tfsPoll, tfsWait, tfsWaitAll
+ * or any call that has to wait for a reply.
+ */
+typedef void (*tfs_callback)(int ticket, int result, void *arg);
+
+int tfsCreateAsync(char *path, char nodeType, tfs_callback callback, void *arg);
+int tfsDeleteAsync(char *path, tfs_callback callback, void *arg);
+int tfsLookupAsync(char *path, tfs_callback callback, void *arg);
+int tfsMoveAsync(char *from, char *to, tfs_callback callback, void *arg);
+int tfsPrintAsync(char *outputfile, tfs_callback callback, void *arg);
+int tfsPoll();
+int tfsWait(int ticket, int *result);
+int tfsWaitAll();
 int tfsUnmount();
 
+/* The same calls on a given session */
+tfs_session *tfsSessionMount(char *serverName);
+tfs_session *tfsSessionMountWith(char *serverName, int flags);
+int tfsSessionUnmount(tfs_session *s);
+int tfsSessionCreate(tfs_session *s, char *path, char nodeType);
+int tfsSessionDelete(tfs_session *s, char *path);
+int tfsSessionLookup(tfs_session *s, char *path);
+int tfsSessionMove(tfs_session *s, char *from, char *to);
+int tfsSessionPrint(tfs_session *s, char *outputfile);
+int tfsSessionOpen(tfs_session *s, char *path, permission mode);
+int tfsSessionClose(tfs_session *s, int handle);
+int tfsSessionMapRead(tfs_session *s, int handle, char **data, int len, long offset);
+int tfsSessionRead(tfs_session *s, int handle, char *buffer, int len, long offset);
+int tfsSessionWrite(tfs_session *s, int handle, char *buffer, int len, long offset);
+int tfsSessionAppend(tfs_session *s, int handle, char *buffer, int len);
+int tfsSessionTruncate(tfs_session *s, int handle, long size);
+int tfsSessionBatchBegin(tfs_session *s);
+int tfsSessionBatchCreate(tfs_session *s, char *path, char nodeType);
+int tfsSessionBatchDelete(tfs_session *s, char *path);
+int tfsSessionBatchLookup(tfs_session *s, char *path);
+int tfsSessionBatchMove(tfs_session *s, char *from, char *to);
+int tfsSessionBatchSubmit(tfs_session *s, int *results);
+int tfsSessionCreateAsync(tfs_session *s, char *path, char nodeType,
+                          tfs_callback callback, void *arg);
+int tfsSessionDeleteAsync(tfs_session *s, char *path, tfs_callback callback, void *arg);
+int tfsSessionLookupAsync(tfs_session *s, char *path, tfs_callback callback, void *arg);
+int tfsSessionMoveAsync(tfs_session *s, char *from, char *to, tfs_callback callback, void *arg);
+int tfsSessionPrintAsync(tfs_session *s, char *outputfile, tfs_callback callback, void *arg);
+int tfsSessionPoll(tfs_session *s);
+int tfsSessionWait(tfs_session *s, int ticket, int *result);
+int tfsSessionWaitAll(tfs_session *s);
+
 #endif /* CLIENT_H */
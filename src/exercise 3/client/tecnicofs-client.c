@@ -1,25 +1,76 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "tecnicofs-client-api.h"
 #include "../tecnicofs-api-constants.h"
 
+/* Most commands sent in a batch with -b */
+#define BATCH_SIZE 64
+
+/* Size of the reads of r, which are split by the api anyway */
+#define READ_SIZE (1 << 20)
+/* Size of the mappings of R, so large files take a few */
+#define MAP_SIZE (4 << 20)
+
 FILE* inputFile;
 char* serverName;
+int mountFlags = 0;
+int batchMode = 0; /* most commands in a batch, 0 without batches */
+int asyncMode = 0;
+int numSessions = 0;
 
 static void displayUsage (const char* appName) {
-    printf("Usage: %s inputfile server_socket_name\n", appName);
+    printf("Usage: %s [-t] [-n] [-b | -B size | -a | -s sessions] inputfile server_socket_name\n", appName);
+    printf("  -t: use the text protocol instead of the binary one\n");
+    printf("  -n: send file data through the socket instead of the shared ring\n");
+    printf("  -b: send the commands between prints in batches\n");
+    printf("  -B: the same, with batches of up to this many commands\n");
+    printf("  -a: send the commands without waiting for their replies\n");
+    printf("  -s: run the input on this many threads at once, each in its own directory\n");
     exit(EXIT_FAILURE);
 }
 
 static void parseArgs (long argc, char* const argv[]) {
-    if (argc != 3) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tnbB:as:")) != -1) {
+        switch (opt) {
+            case 't':
+                mountFlags |= TFS_MOUNT_TEXT;
+                break;
+            case 'n':
+                mountFlags |= TFS_MOUNT_NO_SHM;
+                break;
+            case 'b':
+                batchMode = BATCH_SIZE;
+                break;
+            case 'B':
+                if ((batchMode = atoi(optarg)) <= 0)
+                    displayUsage(argv[0]);
+                break;
+            case 'a':
+                asyncMode = 1;
+                break;
+            case 's':
+                if ((numSessions = atoi(optarg)) <= 0)
+                    displayUsage(argv[0]);
+                break;
+            default:
+                displayUsage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
         fprintf(stderr, "Invalid format:\n");
         displayUsage(argv[0]);
     }
 
-    serverName = argv[2];
+    serverName = argv[optind + 1];
 
-    inputFile = fopen(argv[1], "r");
+    inputFile = fopen(argv[optind], "r");
 
     if (inputFile== NULL) {
         fprintf(stderr, "Error: cannot open input file\n");
@@ -32,103 +83,511 @@ void errorParse(){
     exit(EXIT_FAILURE);
 }
 
-void *processInput() {
-    char line[MAX_INPUT_SIZE];
+/* A command of the input, kept until its result is printed */
+typedef struct command {
+    char op;
+    char nodeType;
+    int count;
+    char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
+} command;
 
-    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
-        char op;
-        char arg1[MAX_INPUT_SIZE], arg2[MAX_INPUT_SIZE];
-        int res;
+/* A command queued in a batch, with its arguments copied out */
+typedef struct batched {
+    char op;
+    char nodeType;
+    char* arg1;
+    char* arg2;
+} batched;
 
-        int numTokens = sscanf(line, "%c %s %s", &op, arg1, arg2);
+/* Commands queued in the current batch (-b), and room for their results */
+batched* batch = NULL;
+int* batchResults = NULL;
+int batchSize = 0;
 
-        /* perform minimal validation */
-        if (numTokens < 1) {
-            continue;
-        }
-        switch (op) {
-            case 'c':
-                if(numTokens != 3) {
-                    errorParse();
-                    break;
-                }
-                switch (arg2[0]) {
-                    case 'f':
-                        res = tfsCreate(arg1, 'f');
-                        if (!res)
-                          printf("Created file: %s\n", arg1);
-                        else
-                          printf("Unable to create file: %s\n", arg1);
-                        break;
-                    case 'd':
-                        res = tfsCreate(arg1, 'd');
-                        if (!res)
-                          printf("Created directory: %s\n", arg1);
-                        else
-                          printf("Unable to create directory: %s\n", arg1);
-                        break;
-                    default:
-                        fprintf(stderr, "Error: invalid node type\n");
-                }
-                break;
-            case 'l':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsLookup(arg1);
-                if (res >= 0)
-                    printf("Search: %s found\n", arg1);
-                else
-                    printf("Search: %s not found\n", arg1);
-                break;
-            case 'd':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsDelete(arg1);
+/*
+ * Prints the result of a command.
+ */
+static void printResult(FILE* out, command* cmd, int res) {
+    switch (cmd->op) {
+        case 'c':
+            if (cmd->nodeType == 'f') {
                 if (!res)
-                  printf("Deleted: %s\n", arg1);
+                  fprintf(out, "Created file: %s\n", cmd->arg1);
                 else
-                  printf("Unable to delete: %s\n", arg1);
-                break;
-            case 'm':
-                if(numTokens != 3)
-                    errorParse();
-                res = tfsMove(arg1, arg2);
-                if (!res)
-                  printf("Moved: %s to %s\n", arg1, arg2);
-                else
-                  printf("Unable to move: %s to %s\n", arg1, arg2);
-                break;
-            case 'p':
-                if(numTokens != 2)
-                    errorParse();
-                res = tfsPrint(arg1);
+                  fprintf(out, "Unable to create file: %s\n", cmd->arg1);
+            }
+            else {
                 if (!res)
-                  printf("Printed: to %s\n", arg1);
+                  fprintf(out, "Created directory: %s\n", cmd->arg1);
                 else
-                  printf("Unable to Print: %s \n", arg1);
-                break;
-            case '#':
-                break;
-            default: { /* error */
+                  fprintf(out, "Unable to create directory: %s\n", cmd->arg1);
+            }
+            break;
+        case 'l':
+            if (res >= 0)
+                fprintf(out, "Search: %s found\n", cmd->arg1);
+            else
+                fprintf(out, "Search: %s not found\n", cmd->arg1);
+            break;
+        case 'd':
+            if (!res)
+              fprintf(out, "Deleted: %s\n", cmd->arg1);
+            else
+              fprintf(out, "Unable to delete: %s\n", cmd->arg1);
+            break;
+        case 'm':
+            if (!res)
+              fprintf(out, "Moved: %s to %s\n", cmd->arg1, cmd->arg2);
+            else
+              fprintf(out, "Unable to move: %s to %s\n", cmd->arg1, cmd->arg2);
+            break;
+        case 'p':
+            if (!res)
+              fprintf(out, "Printed: to %s\n", cmd->arg1);
+            else
+              fprintf(out, "Unable to Print: %s \n", cmd->arg1);
+            break;
+    }
+}
+
+/*
+ * Tells whether a command works on the contents of a file.
+ */
+static int isFileCommand(char op) {
+    return op == 'a' || op == 'r' || op == 'R';
+}
+
+/*
+ * Runs a file command on a session, the default one if NULL, and prints
+ * its result: an append of arg2 repeated count times, or a read of the
+ * whole file, printed after its size. R reads by mapping the file, in
+ * pieces of MAP_SIZE, and prints the same as r.
+ */
+static void fileCommand(FILE* out, tfs_session* s, command* cmd) {
+    permission mode = cmd->op == 'a' ? WRITE : READ;
+    size_t len = strlen(cmd->arg2), appended = len * cmd->count;
+    int handle, res = 0, total = 0;
+    char* data = NULL;
+    char* map;
+
+    // the api counts bytes in an int
+    if (cmd->op == 'a' && appended > INT_MAX) {
+        fprintf(out, "Unable to append to file: %s\n", cmd->arg1);
+        return;
+    }
+    handle = s ? tfsSessionOpen(s, cmd->arg1, mode) : tfsOpen(cmd->arg1, mode);
+    if (handle < 0) {
+        fprintf(out, "Unable to open file: %s\n", cmd->arg1);
+        return;
+    }
+
+    if (cmd->op == 'a') {
+        if ((data = malloc(appended + 1)) == NULL) {
+            fprintf(stderr, "Error: failed to allocate file data\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < cmd->count; i++)
+            memcpy(data + i * len, cmd->arg2, len);
+        res = s ? tfsSessionAppend(s, handle, data, appended) : tfsAppend(handle, data, appended);
+        if (res == (int) appended)
+            fprintf(out, "Appended %d bytes to file: %s\n", res, cmd->arg1);
+        else
+            fprintf(out, "Unable to append to file: %s\n", cmd->arg1);
+    }
+    else {
+        if (cmd->op == 'r' && (data = malloc(READ_SIZE)) == NULL) {
+            fprintf(stderr, "Error: failed to allocate file data\n");
+            exit(EXIT_FAILURE);
+        }
+        // read in pieces until the end, so the size is known before the contents
+        char* contents = NULL;
+        size_t size = 0;
+        FILE* file = open_memstream(&contents, &size);
+
+        if (file == NULL) {
+            fprintf(stderr, "Error: failed to allocate file data\n");
+            exit(EXIT_FAILURE);
+        }
+        do {
+            if (cmd->op == 'R') {
+                res = s ? tfsSessionMapRead(s, handle, &map, MAP_SIZE, total)
+                        : tfsMapRead(handle, &map, MAP_SIZE, total);
+                if (res > 0) {
+                    fwrite(map, 1, res, file);
+                    tfsUnmapRead(map, res);
+                }
+            }
+            else {
+                res = s ? tfsSessionRead(s, handle, data, READ_SIZE, total)
+                        : tfsRead(handle, data, READ_SIZE, total);
+                if (res > 0)
+                    fwrite(data, 1, res, file);
+            }
+            total += res > 0 ? res : 0;
+        } while (res > 0);
+        fclose(file);
+        if (res == 0) {
+            fprintf(out, "Read %d bytes from file: %s\n", total, cmd->arg1);
+            fwrite(contents, 1, size, out);
+            fprintf(out, "\n");
+        }
+        else
+            fprintf(out, "Unable to read file: %s\n", cmd->arg1);
+        free(contents);
+    }
+    free(data);
+    if (s)
+        tfsSessionClose(s, handle);
+    else
+        tfsClose(handle);
+}
+
+/*
+ * Sends the queued commands in a single batch and prints their results.
+ */
+static void submitBatch() {
+    static command cmd;
+
+    if (batchSize == 0)
+        return;
+    if (tfsBatchSubmit(batchResults) != batchSize) {
+        fprintf(stderr, "Error: batch failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < batchSize; i++) {
+        cmd.op = batch[i].op;
+        cmd.nodeType = batch[i].nodeType;
+        strcpy(cmd.arg1, batch[i].arg1);
+        strcpy(cmd.arg2, batch[i].arg2);
+        printResult(stdout, &cmd, batchResults[i]);
+        free(batch[i].arg1);
+        free(batch[i].arg2);
+    }
+    batchSize = 0;
+}
+
+/*
+ * Queues a command in the current batch; prints and file commands go
+ * alone, once the commands before them are applied.
+ */
+static void batchCommand(command* cmd) {
+    if (cmd->op == 'p') {
+        submitBatch();
+        printResult(stdout, cmd, tfsPrint(cmd->arg1));
+        return;
+    }
+    if (isFileCommand(cmd->op)) {
+        submitBatch();
+        fileCommand(stdout, NULL, cmd);
+        return;
+    }
+    if (batch == NULL &&
+        ((batch = malloc(batchMode * sizeof(batched))) == NULL ||
+         (batchResults = malloc(batchMode * sizeof(int))) == NULL)) {
+        fprintf(stderr, "Error: failed to allocate batch\n");
+        exit(EXIT_FAILURE);
+    }
+    if (batchSize == 0)
+        tfsBatchBegin();
+    switch (cmd->op) {
+        case 'c': tfsBatchCreate(cmd->arg1, cmd->nodeType); break;
+        case 'l': tfsBatchLookup(cmd->arg1); break;
+        case 'd': tfsBatchDelete(cmd->arg1); break;
+        case 'm': tfsBatchMove(cmd->arg1, cmd->arg2); break;
+    }
+    batch[batchSize] = (batched) { .op = cmd->op, .nodeType = cmd->nodeType,
+                                   .arg1 = strdup(cmd->arg1), .arg2 = strdup(cmd->arg2) };
+    if (batch[batchSize].arg1 == NULL || batch[batchSize].arg2 == NULL) {
+        fprintf(stderr, "Error: failed to allocate batch\n");
+        exit(EXIT_FAILURE);
+    }
+    if (++batchSize == batchMode)
+        submitBatch();
+}
+
+/*
+ * Callback of an asynchronous command: prints its result. Replies come
+ * in the order of the requests, so results are printed in input order.
+ */
+static void asyncDone(int ticket, int result, void* arg) {
+    printResult(stdout, arg, result);
+    free(arg);
+}
+
+/*
+ * Sends a command without waiting for its reply; a print waits for its
+ * ticket, which first runs the callbacks of the commands before it.
+ * File commands wait for all the commands before them.
+ */
+static void asyncCommand(command* cmd) {
+    command* copy;
+    int ticket, res;
+
+    if (isFileCommand(cmd->op)) {
+        tfsWaitAll();
+        fileCommand(stdout, NULL, cmd);
+        return;
+    }
+    if (cmd->op == 'p') {
+        ticket = tfsPrintAsync(cmd->arg1, NULL, NULL);
+        if (ticket < 0 || tfsWait(ticket, &res) < 0)
+            res = TECNICOFS_ERROR_OTHER;
+        printResult(stdout, cmd, res);
+        return;
+    }
+    if ((copy = malloc(sizeof(command))) == NULL) {
+        fprintf(stderr, "Error: failed to allocate command\n");
+        exit(EXIT_FAILURE);
+    }
+    *copy = *cmd;
+    switch (cmd->op) {
+        case 'c': ticket = tfsCreateAsync(cmd->arg1, cmd->nodeType, asyncDone, copy); break;
+        case 'l': ticket = tfsLookupAsync(cmd->arg1, asyncDone, copy); break;
+        case 'd': ticket = tfsDeleteAsync(cmd->arg1, asyncDone, copy); break;
+        default: ticket = tfsMoveAsync(cmd->arg1, cmd->arg2, asyncDone, copy);
+    }
+    if (ticket < 0)
+        asyncDone(ticket, ticket, copy);
+}
+
+/*
+ * Applies a command and prints its result.
+ */
+static void runCommand(command* cmd) {
+    int res;
+
+    if (isFileCommand(cmd->op)) {
+        fileCommand(stdout, NULL, cmd);
+        return;
+    }
+    switch (cmd->op) {
+        case 'c': res = tfsCreate(cmd->arg1, cmd->nodeType); break;
+        case 'l': res = tfsLookup(cmd->arg1); break;
+        case 'd': res = tfsDelete(cmd->arg1); break;
+        case 'm': res = tfsMove(cmd->arg1, cmd->arg2); break;
+        default: res = tfsPrint(cmd->arg1);
+    }
+    printResult(stdout, cmd, res);
+}
+
+/*
+ * Parses a line of the input.
+ * Returns: 1 for a command, 0 for a line to skip
+ */
+static int parseCommand(char* line, command* cmd) {
+    int numTokens = sscanf(line, "%c %s %s", &cmd->op, cmd->arg1, cmd->arg2);
+
+    /* perform minimal validation */
+    if (numTokens < 1) {
+        return 0;
+    }
+    switch (cmd->op) {
+        case 'c':
+            if(numTokens != 3) {
                 errorParse();
+                break;
             }
+            if (cmd->arg2[0] != 'f' && cmd->arg2[0] != 'd') {
+                fprintf(stderr, "Error: invalid node type\n");
+                return 0;
+            }
+            cmd->nodeType = cmd->arg2[0];
+            break;
+        case 'l':
+        case 'd':
+        case 'p':
+            if(numTokens != 2)
+                errorParse();
+            break;
+        case 'm':
+            if(numTokens != 3)
+                errorParse();
+            break;
+        case 'a': {
+            /* the text is the rest of the line after a single separator, spaces included */
+            int text;
+            if (sscanf(line, "%c %s %d%n", &cmd->op, cmd->arg1, &cmd->count, &text) != 3 ||
+                cmd->count <= 0 || (line[text] != ' ' && line[text] != '\t'))
+                errorParse();
+            strcpy(cmd->arg2, line + text + 1);
+            cmd->arg2[strcspn(cmd->arg2, "\n")] = '\0';
+            break;
+        }
+        case 'r':
+        case 'R':
+            if(numTokens != 2)
+                errorParse();
+            break;
+        case '#':
+            return 0;
+        default: { /* error */
+            errorParse();
         }
     }
+    return 1;
+}
+
+void *processInput() {
+    char line[MAX_INPUT_SIZE];
+    static command cmd;
+
+    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
+        if (!parseCommand(line, &cmd))
+            continue;
+
+        if (batchMode)
+            batchCommand(&cmd);
+        else if (asyncMode)
+            asyncCommand(&cmd);
+        else
+            runCommand(&cmd);
+    }
+    submitBatch();
+    tfsWaitAll();
     fclose(inputFile);
     return NULL;
 }
 
+/* A thread of -s: the session it uses and the output it printed */
+typedef struct sessionRun {
+    int id;
+    tfs_session* session;
+    char** lines;
+    int numLines;
+    char* out;
+    size_t outSize;
+} sessionRun;
+
+/*
+ * Moves a path of the input into the directory of a thread.
+ */
+static void sessionPath(char* path, int id) {
+    char prefixed[MAX_INPUT_SIZE];
+
+    snprintf(prefixed, sizeof(prefixed), "/s%d/%s", id, path[0] == '/' ? path + 1 : path);
+    strcpy(path, prefixed);
+}
+
+/*
+ * Thread of -s: runs the whole input on its session, inside /s<id>.
+ * Its prints go to the file given with .s<id> appended.
+ */
+static void* sessionThread(void* arg) {
+    sessionRun* run = arg;
+    tfs_session* s = run->session;
+    FILE* out = open_memstream(&run->out, &run->outSize);
+    command* cmd = malloc(sizeof(command));
+    int res;
+
+    if (out == NULL || cmd == NULL) {
+        fprintf(stderr, "Error: failed to allocate session output\n");
+        exit(EXIT_FAILURE);
+    }
+
+    cmd->op = 'c';
+    cmd->nodeType = 'd';
+    snprintf(cmd->arg1, sizeof(cmd->arg1), "/s%d", run->id);
+    printResult(out, cmd, tfsSessionCreate(s, cmd->arg1, 'd'));
+
+    for (int i = 0; i < run->numLines; i++) {
+        if (!parseCommand(run->lines[i], cmd))
+            continue;
+        if (isFileCommand(cmd->op)) {
+            sessionPath(cmd->arg1, run->id);
+            fileCommand(out, s, cmd);
+            continue;
+        }
+        if (cmd->op == 'p')
+            snprintf(cmd->arg1 + strlen(cmd->arg1), sizeof(cmd->arg1) - strlen(cmd->arg1), ".s%d", run->id);
+        else
+            sessionPath(cmd->arg1, run->id);
+        if (cmd->op == 'm')
+            sessionPath(cmd->arg2, run->id);
+
+        switch (cmd->op) {
+            case 'c': res = tfsSessionCreate(s, cmd->arg1, cmd->nodeType); break;
+            case 'l': res = tfsSessionLookup(s, cmd->arg1); break;
+            case 'd': res = tfsSessionDelete(s, cmd->arg1); break;
+            case 'm': res = tfsSessionMove(s, cmd->arg1, cmd->arg2); break;
+            default: res = tfsSessionPrint(s, cmd->arg1);
+        }
+        printResult(out, cmd, res);
+    }
+
+    free(cmd);
+    fclose(out);
+    return NULL;
+}
+
+/*
+ * Runs the input on numSessions threads at once, each in its own
+ * directory. The even threads mount a session of their own and the odd
+ * ones share one. The output of each thread is printed once all are done.
+ */
+void runSessions() {
+    char line[MAX_INPUT_SIZE];
+    char** lines = NULL;
+    int numLines = 0;
+    pthread_t tid[numSessions];
+    sessionRun runs[numSessions];
+    tfs_session* shared = tfsSessionMountWith(serverName, mountFlags);
+
+    if (shared == NULL) {
+        fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line)/sizeof(char), inputFile)) {
+        if ((lines = realloc(lines, (numLines + 1) * sizeof(char*))) == NULL ||
+            (lines[numLines++] = strdup(line)) == NULL) {
+            fprintf(stderr, "Error: failed to allocate input\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(inputFile);
+
+    for (int i = 0; i < numSessions; i++) {
+        runs[i] = (sessionRun) { .id = i, .lines = lines, .numLines = numLines };
+        runs[i].session = i % 2 == 0 ? tfsSessionMountWith(serverName, mountFlags) : shared;
+        if (runs[i].session == NULL) {
+            fprintf(stderr, "Unable to mount socket: %s\n", serverName);
+            exit(EXIT_FAILURE);
+        }
+        if (pthread_create(&tid[i], NULL, sessionThread, &runs[i]) != 0) {
+            perror("Error: failed to create a thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < numSessions; i++) {
+        if (pthread_join(tid[i], NULL) != 0) {
+            perror("Error: failed to join a thread");
+            exit(EXIT_FAILURE);
+        }
+        fwrite(runs[i].out, 1, runs[i].outSize, stdout);
+        free(runs[i].out);
+        if (runs[i].session != shared)
+            tfsSessionUnmount(runs[i].session);
+    }
+    tfsSessionUnmount(shared);
+
+    for (int i = 0; i < numLines; i++)
+        free(lines[i]);
+    free(lines);
+}
+
 int main(int argc, char* argv[]) {
     parseArgs(argc, argv);
     
-    if (tfsMount(serverName) == 0)
+    if (tfsMountWith(serverName, mountFlags) == 0)
       printf("Mounted! (socket = %s)\n", serverName);
     else {
       fprintf(stderr, "Unable to mount socket: %s\n", serverName);
       exit(EXIT_FAILURE);
     }
 
-    processInput();
+    if (numSessions > 0)
+        runSessions();
+    else
+        processInput();
 
     tfsUnmount();
 
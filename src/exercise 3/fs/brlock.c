@@ -0,0 +1,93 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "brlock.h"
+
+/*
+ * One shard per cache line, so readers on different shards do not
+ * bounce the same line between cores.
+ */
+typedef struct brlock_shard {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) brlock_shard;
+
+static brlock_shard shards[BRLOCK_SHARDS];
+
+/* Used to spread threads over the shards */
+static int next_shard = 0;
+static __thread int my_shard = -1;
+
+
+/*
+ * Returns the shard of the calling thread.
+ */
+static inline pthread_rwlock_t *shard_lock() {
+    if (my_shard < 0)
+        my_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % BRLOCK_SHARDS;
+    return &shards[my_shard].lock;
+}
+
+
+/*
+ * Initializes the shards. Writers are preferred, so a writer is not
+ * starved by a steady stream of readers.
+ */
+void brlock_init() {
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < BRLOCK_SHARDS; i++) {
+        if ( pthread_rwlock_init(&shards[i].lock, &attr) != 0 ) {
+            perror("Error: failed to init brlock");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+
+void brlock_destroy() {
+    for (int i = 0; i < BRLOCK_SHARDS; i++)
+        pthread_rwlock_destroy(&shards[i].lock);
+}
+
+
+void brlock_read_lock() {
+    if ( pthread_rwlock_rdlock(shard_lock()) != 0 ) {
+        perror("Error: failed to rdlock brlock");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+void brlock_read_unlock() {
+    if ( pthread_rwlock_unlock(shard_lock()) != 0 ) {
+        perror("Error: failed to unlock brlock");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Takes every shard, always in the same order.
+ */
+void brlock_write_lock() {
+    for (int i = 0; i < BRLOCK_SHARDS; i++) {
+        if ( pthread_rwlock_wrlock(&shards[i].lock) != 0 ) {
+            perror("Error: failed to wrlock brlock");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+void brlock_write_unlock() {
+    for (int i = BRLOCK_SHARDS - 1; i >= 0; i--) {
+        if ( pthread_rwlock_unlock(&shards[i].lock) != 0 ) {
+            perror("Error: failed to unlock brlock");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
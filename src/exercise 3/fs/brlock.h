@@ -0,0 +1,20 @@
+#ifndef BRLOCK_H
+#define BRLOCK_H
+
+/*
+ * Big-reader lock: a reader/writer lock split into BRLOCK_SHARDS
+ * independent rwlocks. A reader only takes the shard of its thread, so
+ * readers on different threads never share a lock word; a writer takes
+ * every shard.
+ */
+#define BRLOCK_SHARDS 64
+
+/* Prototype functions of brlock.c */
+void brlock_init();
+void brlock_destroy();
+void brlock_read_lock();
+void brlock_read_unlock();
+void brlock_write_lock();
+void brlock_write_unlock();
+
+#endif /* BRLOCK_H */
@@ -0,0 +1,737 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "checkpoint.h"
+#include "state.h"
+#include "wal.h"
+
+/* Size of the stdio buffer the images are written through */
+#define CHECKPOINT_BUFFER_SIZE (1 << 20)
+
+/*
+ * An image being written: the directories go straight to the file, the
+ * i-nodes are gathered and written at the end.
+ */
+typedef struct image_writer {
+    FILE *fp;
+    char temp_path[MAX_PATH_SIZE];
+    long off;
+    checkpoint_inode *inodes;
+    int num_inodes;
+    int capacity;
+    int table_size;
+} image_writer;
+
+/* A mapped image */
+typedef struct image {
+    char *data;
+    size_t size;
+    checkpoint_header header;
+    checkpoint_inode *inodes;
+} image;
+
+/* The loaded images, mapped until checkpoint_close */
+static image *loaded = NULL;
+static int num_loaded = 0;
+
+/* What is on disk: the base may be missing or stale (a delta failed),
+ * and then the next checkpoint has to write a new base */
+static int have_base = 0;
+static int num_deltas = 0;
+static size_t base_size = 0;
+static size_t deltas_size = 0;
+
+static char *data_dir;
+static pthread_t checkpoint_thread;
+static int running = 0;
+static int stopping = 0;
+static int requested = 0;
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+static checkpoint_take take_checkpoint;
+
+
+/*
+ * Builds the path of a file inside the data directory.
+ * Returns: SUCCESS or FAIL if it is too long
+ */
+static int data_path(char *path, char *dir, char *name) {
+    if (snprintf(path, MAX_PATH_SIZE, "%s/%s", dir, name) >= MAX_PATH_SIZE) {
+        fprintf(stderr, "Error: data directory path too long\n");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Makes the entries of the data directory durable.
+ * Returns: SUCCESS or FAIL
+ */
+static int sync_dir(char *dir) {
+    int dir_fd;
+
+    if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        fsync(dir_fd) < 0 || close(dir_fd) < 0) {
+        perror("Checkpoint: failed to sync data directory");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+
+static int delta_compare(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Lists the deltas in the data directory.
+ * Input:
+ *  - dir: data directory
+ *  - num: reference to an int, to store the number of deltas
+ * Returns: their segments, sorted, in an array the caller frees
+ */
+static unsigned long *list_deltas(char *dir, int *num) {
+    unsigned long *segs = NULL;
+    int size = 0;
+    struct dirent *ent;
+    DIR *d;
+
+    if ((d = opendir(dir)) == NULL) {
+        perror("Error: failed to open data directory");
+        exit(EXIT_FAILURE);
+    }
+    *num = 0;
+    while ((ent = readdir(d)) != NULL) {
+        unsigned long seg;
+        int len;
+
+        if (sscanf(ent->d_name, CHECKPOINT_DELTA_FORMAT "%n", &seg, &len) != 1 ||
+            ent->d_name[len] != '\0')
+            continue;
+        if (*num == size) {
+            size = size > 0 ? 2 * size : 16;
+            if ((segs = realloc(segs, sizeof(unsigned long) * size)) == NULL) {
+                perror("Error: failed to list checkpoints");
+                exit(EXIT_FAILURE);
+            }
+        }
+        segs[(*num)++] = seg;
+    }
+    closedir(d);
+    qsort(segs, *num, sizeof(unsigned long), delta_compare);
+    return segs;
+}
+
+
+/*
+ * Removes the deltas up to a given segment.
+ * Returns: SUCCESS or FAIL
+ */
+static int remove_deltas(char *dir, unsigned long segment) {
+    char name[MAX_FILE_NAME], path[MAX_PATH_SIZE];
+    unsigned long *segs;
+    int num, res = SUCCESS;
+
+    segs = list_deltas(dir, &num);
+    for (int i = 0; i < num && segs[i] <= segment; i++) {
+        snprintf(name, sizeof(name), CHECKPOINT_DELTA_FORMAT, segs[i]);
+        if (data_path(path, dir, name) == FAIL || (unlink(path) < 0 && errno != ENOENT)) {
+            perror("Checkpoint: failed to remove delta");
+            res = FAIL;
+        }
+    }
+    free(segs);
+    return res;
+}
+
+
+/*
+ * Starts writing an image, aside from the images in use.
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_open(image_writer *w, char *dir) {
+    checkpoint_header header;
+
+    memset(w, 0, sizeof(*w));
+    if (data_path(w->temp_path, dir, CHECKPOINT_TEMP_NAME) == FAIL)
+        return FAIL;
+    if ((w->fp = fopen(w->temp_path, "w")) == NULL) {
+        perror("Checkpoint: failed to open file");
+        return FAIL;
+    }
+    setvbuf(w->fp, NULL, _IOFBF, CHECKPOINT_BUFFER_SIZE);
+
+    /* the header is only filled in at the end */
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, w->fp) != 1) {
+        perror("Checkpoint: failed to write");
+        fclose(w->fp);
+        unlink(w->temp_path);
+        return FAIL;
+    }
+    w->off = sizeof(header);
+    return SUCCESS;
+}
+
+
+/*
+ * Drops an image that could not be written.
+ */
+static void writer_abort(image_writer *w) {
+    fclose(w->fp);
+    unlink(w->temp_path);
+    free(w->inodes);
+}
+
+
+/*
+ * Adds an i-node to an image being written.
+ * Input:
+ *  - w: the image
+ *  - inumber: identifier of the i-node
+ *  - nType: its type
+ *  - dir: its entries, if it is a directory, or NULL
+ *  - dir_image: the image of its entries, instead of dir, or NULL
+ *  - dir_size: size of dir_image
+ * Returns: SUCCESS or FAIL
+ */
+static int writer_add(image_writer *w, int inumber, type nType, DirTable *dir,
+                      char *dir_image, long dir_size) {
+    static const char zeros[8];
+    checkpoint_inode *inode;
+    long len = 0;
+
+    if (w->num_inodes == w->capacity) {
+        w->capacity = w->capacity > 0 ? 2 * w->capacity : 1024;
+        if ((w->inodes = realloc(w->inodes, sizeof(checkpoint_inode) * w->capacity)) == NULL) {
+            perror("Checkpoint: failed to allocate");
+            exit(EXIT_FAILURE);
+        }
+    }
+    inode = &w->inodes[w->num_inodes++];
+    inode->inumber = inumber;
+    inode->type = nType;
+    inode->dir_offset = 0;
+    if (inumber >= w->table_size)
+        w->table_size = inumber + 1;
+
+    if (dir != NULL)
+        len = dir_table_write(w->fp, dir);
+    else if (dir_image != NULL)
+        len = fwrite(dir_image, 1, dir_size, w->fp) == dir_size ? dir_size : FAIL;
+    else
+        return SUCCESS;
+    if (len == FAIL || fwrite(zeros, 1, -len & 7, w->fp) != (-len & 7)) {
+        perror("Checkpoint: failed to write");
+        return FAIL;
+    }
+    inode->dir_offset = w->off;
+    w->off += (len + 7) & ~7L;
+    return SUCCESS;
+}
+
+
+/*
+ * Ends an image and makes it durable under its name, replacing the
+ * image there was with that name.
+ * Input:
+ *  - w: the image
+ *  - dir: data directory
+ *  - name: name of the image
+ *  - segment: first log segment not covered by the image
+ * Returns: size of the image, or FAIL
+ */
+static long writer_commit(image_writer *w, char *dir, char *name, unsigned long segment) {
+    char path[MAX_PATH_SIZE];
+    checkpoint_header header;
+
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.segment = segment;
+    header.num_inodes = w->num_inodes;
+    header.table_size = w->table_size;
+    header.inodes_offset = w->off;
+    header.size = w->off + sizeof(checkpoint_inode) * w->num_inodes;
+    if (data_path(path, dir, name) == FAIL ||
+        fwrite(w->inodes, sizeof(checkpoint_inode), w->num_inodes, w->fp) != w->num_inodes ||
+        fseek(w->fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, w->fp) != 1 ||
+        fflush(w->fp) != 0 || fsync(fileno(w->fp)) < 0) {
+        perror("Checkpoint: failed to write");
+        writer_abort(w);
+        return FAIL;
+    }
+    free(w->inodes);
+    if (fclose(w->fp) != 0 || rename(w->temp_path, path) < 0) {
+        perror("Checkpoint: failed to write");
+        unlink(w->temp_path);
+        return FAIL;
+    }
+
+    /* the rename must be durable before the log it covers is removed */
+    if (sync_dir(dir) == FAIL)
+        return FAIL;
+    return header.size;
+}
+
+
+/*
+ * Writes every i-node of the active snapshot reachable from the root,
+ * walking down from it.
+ * Returns: SUCCESS or FAIL
+ */
+static int write_tree(image_writer *w) {
+    int *stack, depth = 0, size = 64, res = SUCCESS;
+
+    if ((stack = malloc(sizeof(int) * size)) == NULL) {
+        perror("Checkpoint: failed to allocate");
+        return FAIL;
+    }
+    stack[depth++] = FS_ROOT;
+
+    while (depth > 0 && res == SUCCESS) {
+        int inumber = stack[--depth];
+        type nType;
+        DirTable *entries = inode_snapshot_get(inumber, &nType);
+
+        res = writer_add(w, inumber, nType, entries, NULL, 0);
+        if (entries == NULL)
+            continue;
+
+        if (depth + entries->num_entries > size) {
+            while (depth + entries->num_entries > size)
+                size *= 2;
+            if ((stack = realloc(stack, sizeof(int) * size)) == NULL) {
+                perror("Checkpoint: failed to allocate");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < entries->num_entries; i++)
+            stack[depth++] = entries->entries[i].inumber;
+        free(entries);
+    }
+    free(stack);
+    return res;
+}
+
+
+/*
+ * Writes the i-nodes of a list of changed i-nodes, as seen by the active
+ * snapshot.
+ * Returns: SUCCESS or FAIL
+ */
+static int write_dirty(image_writer *w, int dirty) {
+    for (int inumber = dirty; inumber != FREE_INODE; inumber = inode_dirty_next(inumber)) {
+        type nType;
+        DirTable *entries = inode_snapshot_get(inumber, &nType);
+        int res = writer_add(w, inumber, nType, entries, NULL, 0);
+
+        free(entries);
+        if (res == FAIL)
+            return FAIL;
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Writes a checkpoint of the active snapshot, which must be taken when
+ * the log starts a new segment: a delta with the i-nodes changed since
+ * the last checkpoint or, if there is no base to apply it to, a new base.
+ * Images are written aside and only replace others once durable.
+ * Input:
+ *  - dir: data directory
+ *  - segment: the segment the log started with the snapshot
+ *  - dirty: list of the i-nodes changed since the last checkpoint, as
+ *           returned by inode_dirty_take with the snapshot
+ * Returns: SUCCESS or FAIL
+ */
+int checkpoint_write(char *dir, unsigned long segment, int dirty) {
+    char name[MAX_FILE_NAME];
+    image_writer w;
+    long size;
+
+    if (writer_open(&w, dir) == FAIL) {
+        have_base = 0;
+        return FAIL;
+    }
+
+    if (!have_base) {
+        if (write_tree(&w) == FAIL) {
+            writer_abort(&w);
+            return FAIL;
+        }
+        if ((size = writer_commit(&w, dir, CHECKPOINT_FILE_NAME, segment)) == FAIL)
+            return FAIL;
+        /* the old deltas applied to the old base */
+        remove_deltas(dir, segment);
+        have_base = 1;
+        base_size = size;
+        num_deltas = 0;
+        deltas_size = 0;
+        return SUCCESS;
+    }
+
+    /* without this delta, the next ones would miss its changes */
+    snprintf(name, sizeof(name), CHECKPOINT_DELTA_FORMAT, segment);
+    if (write_dirty(&w, dirty) == FAIL) {
+        writer_abort(&w);
+        have_base = 0;
+        return FAIL;
+    }
+    if ((size = writer_commit(&w, dir, name, segment)) == FAIL) {
+        have_base = 0;
+        return FAIL;
+    }
+    num_deltas++;
+    deltas_size += size;
+    return SUCCESS;
+}
+
+
+/*
+ * Maps an image and checks it.
+ * Input:
+ *  - img: to fill in with the image
+ *  - path: path of the image
+ *  - prot: protection of the mapping
+ * Returns: SUCCESS, or FAIL if there is no such image
+ */
+static int image_map(image *img, char *path, int prot) {
+    checkpoint_header *header = &img->header;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        if (errno == ENOENT)
+            return FAIL;
+        perror("Error: failed to open checkpoint");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("Error: failed to open checkpoint");
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size < sizeof(*header)) {
+        fprintf(stderr, "Error: checkpoint %s is corrupt\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    img->size = st.st_size;
+    img->data = mmap(NULL, img->size, prot, MAP_PRIVATE, fd, 0);
+    if (img->data == MAP_FAILED) {
+        perror("Error: failed to map checkpoint");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    memcpy(header, img->data, sizeof(*header));
+    if (header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+        header->size != img->size || header->num_inodes < 0 || header->table_size < 0 ||
+        header->inodes_offset < sizeof(*header) || header->inodes_offset % 8 != 0 ||
+        header->inodes_offset > img->size ||
+        (img->size - header->inodes_offset) / sizeof(checkpoint_inode) < header->num_inodes) {
+        fprintf(stderr, "Error: checkpoint %s is corrupt\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    img->inodes = (checkpoint_inode *) (img->data + header->inodes_offset);
+    for (int i = 0; i < header->num_inodes; i++) {
+        checkpoint_inode *inode = &img->inodes[i];
+
+        if (inode->inumber < 0 || inode->inumber >= header->table_size ||
+            inode->type < T_FILE || inode->type > T_NONE ||
+            (inode->type == T_DIRECTORY &&
+             (inode->dir_offset < sizeof(*header) || inode->dir_offset % 8 != 0 ||
+              inode->dir_offset >= header->inodes_offset ||
+              dir_image_size(img->data + inode->dir_offset,
+                             header->inodes_offset - inode->dir_offset) == FAIL))) {
+            fprintf(stderr, "Error: checkpoint %s is corrupt\n", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return SUCCESS;
+}
+
+
+/*
+ * Maps an image to restore the i-nodes from, and keeps it mapped.
+ * Returns: SUCCESS, or FAIL if there is no such image
+ */
+static int image_load(char *dir, char *name) {
+    char path[MAX_PATH_SIZE];
+
+    if (data_path(path, dir, name) == FAIL)
+        exit(EXIT_FAILURE);
+    if ((loaded = realloc(loaded, sizeof(image) * (num_loaded + 1))) == NULL) {
+        perror("Error: failed to allocate");
+        exit(EXIT_FAILURE);
+    }
+    if (image_map(&loaded[num_loaded], path, PROT_READ | PROT_WRITE) == FAIL)
+        return FAIL;
+    num_loaded++;
+    return SUCCESS;
+}
+
+
+/*
+ * Restores the i-nodes from the checkpoint in the data directory, if
+ * there is one: its base and then its deltas, in order. The images stay
+ * mapped, privately, and the directories use them in place: their pages
+ * are only read when first touched, and copied when first changed. Must
+ * be called on an empty i-node table.
+ * Input:
+ *  - dir: data directory
+ *  - segment: reference to store the first log segment to replay
+ * Returns: SUCCESS, or FAIL if there is no checkpoint
+ */
+int checkpoint_load(char *dir, unsigned long *segment) {
+    char name[MAX_FILE_NAME];
+    unsigned long *segs;
+    int num, table_size = 0;
+
+    if (image_load(dir, CHECKPOINT_FILE_NAME) == FAIL)
+        return FAIL;
+    *segment = loaded[0].header.segment;
+
+    /* deltas up to the base are left from a compaction cut short */
+    remove_deltas(dir, *segment);
+    segs = list_deltas(dir, &num);
+    for (int i = 0; i < num; i++) {
+        snprintf(name, sizeof(name), CHECKPOINT_DELTA_FORMAT, segs[i]);
+        if (image_load(dir, name) == FAIL || loaded[num_loaded - 1].header.segment != segs[i]) {
+            fprintf(stderr, "Error: checkpoint %s is corrupt\n", name);
+            exit(EXIT_FAILURE);
+        }
+        *segment = segs[i];
+    }
+    free(segs);
+
+    for (int i = 0; i < num_loaded; i++) {
+        image *img = &loaded[i];
+
+        madvise(img->inodes, sizeof(checkpoint_inode) * img->header.num_inodes, MADV_SEQUENTIAL);
+        for (int j = 0; j < img->header.num_inodes; j++) {
+            checkpoint_inode *inode = &img->inodes[j];
+            DirTable *dir_table = NULL;
+
+            if (inode->type == T_DIRECTORY)
+                dir_table = dir_table_map(img->data + inode->dir_offset,
+                                          img->header.inodes_offset - inode->dir_offset);
+            inode_restore(inode->inumber, inode->type, dir_table);
+        }
+        if (img->header.table_size > table_size)
+            table_size = img->header.table_size;
+    }
+    if (table_size <= FS_ROOT) {
+        fprintf(stderr, "Error: checkpoint has no root\n");
+        exit(EXIT_FAILURE);
+    }
+    inode_table_restored(table_size);
+
+    have_base = 1;
+    base_size = loaded[0].size;
+    num_deltas = num_loaded - 1;
+    deltas_size = 0;
+    for (int i = 1; i < num_loaded; i++)
+        deltas_size += loaded[i].size;
+    return SUCCESS;
+}
+
+
+/*
+ * Merges the deltas into the base, if there are enough of them: the
+ * latest state of each i-node is copied from the images to a new base,
+ * without looking at the fs. Called by the checkpoint thread.
+ * Input:
+ *  - dir: data directory
+ */
+static void checkpoint_compact(char *dir) {
+    char path[MAX_PATH_SIZE], name[MAX_FILE_NAME];
+    checkpoint_inode **latest;
+    char **latest_data;
+    unsigned long *segs;
+    image *imgs;
+    int num, table_size = 0;
+    image_writer w;
+    long size;
+
+    if (!have_base || num_deltas == 0 ||
+        (num_deltas < CHECKPOINT_MAX_DELTAS && deltas_size <= base_size))
+        return;
+
+    segs = list_deltas(dir, &num);
+    if ((imgs = malloc(sizeof(image) * (num + 1))) == NULL) {
+        perror("Checkpoint: failed to allocate");
+        exit(EXIT_FAILURE);
+    }
+    data_path(path, dir, CHECKPOINT_FILE_NAME);
+    if (image_map(&imgs[0], path, PROT_READ) == FAIL) {
+        fprintf(stderr, "Checkpoint: base image is missing\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num; i++) {
+        snprintf(name, sizeof(name), CHECKPOINT_DELTA_FORMAT, segs[i]);
+        data_path(path, dir, name);
+        if (image_map(&imgs[i + 1], path, PROT_READ) == FAIL) {
+            fprintf(stderr, "Checkpoint: delta %s is missing\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i <= num; i++) {
+        madvise(imgs[i].data, imgs[i].size, MADV_SEQUENTIAL);
+        if (imgs[i].header.table_size > table_size)
+            table_size = imgs[i].header.table_size;
+    }
+
+    /* the image holding the latest state of each i-node */
+    latest = calloc(table_size, sizeof(checkpoint_inode *));
+    latest_data = calloc(table_size, sizeof(char *));
+    if (latest == NULL || latest_data == NULL) {
+        perror("Checkpoint: failed to allocate");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i <= num; i++) {
+        for (int j = 0; j < imgs[i].header.num_inodes; j++) {
+            checkpoint_inode *inode = &imgs[i].inodes[j];
+            latest[inode->inumber] = inode;
+            latest_data[inode->inumber] = imgs[i].data;
+        }
+    }
+
+    int res = writer_open(&w, dir);
+    for (int inumber = 0; res == SUCCESS && inumber < table_size; inumber++) {
+        checkpoint_inode *inode = latest[inumber];
+        char *dir_image = NULL;
+        long dir_size = 0;
+
+        if (inode == NULL || inode->type == T_NONE)
+            continue;
+        if (inode->type == T_DIRECTORY) {
+            dir_image = latest_data[inumber] + inode->dir_offset;
+            dir_size = dir_image_size(dir_image, SIZE_MAX);
+        }
+        if ((res = writer_add(&w, inumber, inode->type, NULL, dir_image, dir_size)) == FAIL)
+            writer_abort(&w);
+    }
+    if (res == SUCCESS &&
+        (size = writer_commit(&w, dir, CHECKPOINT_FILE_NAME, imgs[num].header.segment)) != FAIL &&
+        remove_deltas(dir, imgs[num].header.segment) == SUCCESS && sync_dir(dir) == SUCCESS) {
+        base_size = size;
+        num_deltas = 0;
+        deltas_size = 0;
+    }
+
+    for (int i = 0; i <= num; i++)
+        munmap(imgs[i].data, imgs[i].size);
+    free(latest);
+    free(latest_data);
+    free(imgs);
+    free(segs);
+}
+
+
+/*
+ * Checkpoint thread: takes a checkpoint whenever the log has grown enough,
+ * or some time after anything was logged, and compacts the images.
+ */
+static void *checkpointer(void *arg) {
+    struct timespec last, now, wake;
+
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    pthread_mutex_lock(&checkpoint_lock);
+    while (!stopping) {
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec++;
+        pthread_cond_timedwait(&stop_cond, &checkpoint_lock, &wake);
+        if (stopping)
+            break;
+        pthread_mutex_unlock(&checkpoint_lock);
+
+        unsigned long bytes = wal_segment_bytes();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (__atomic_exchange_n(&requested, 0, __ATOMIC_RELAXED) ||
+            bytes >= CHECKPOINT_LOG_SIZE ||
+            (bytes > 0 && now.tv_sec - last.tv_sec >= CHECKPOINT_PERIOD)) {
+            take_checkpoint();
+            checkpoint_compact(data_dir);
+            clock_gettime(CLOCK_MONOTONIC, &last);
+        }
+        else if (bytes == 0)
+            last = now;
+
+        pthread_mutex_lock(&checkpoint_lock);
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+    return NULL;
+}
+
+
+/*
+ * Starts the checkpoint thread.
+ * Input:
+ *  - dir: data directory
+ *  - take: takes a checkpoint
+ */
+void checkpoint_start(char *dir, checkpoint_take take) {
+    data_dir = dir;
+    take_checkpoint = take;
+    stopping = 0;
+    if (pthread_create(&checkpoint_thread, NULL, checkpointer, NULL) != 0) {
+        perror("Error: failed to create checkpoint thread");
+        exit(EXIT_FAILURE);
+    }
+    running = 1;
+}
+
+
+/*
+ * Stops the checkpoint thread, letting a checkpoint being taken finish.
+ */
+void checkpoint_stop() {
+    if (!running)
+        return;
+
+    pthread_mutex_lock(&checkpoint_lock);
+    stopping = 1;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&checkpoint_lock);
+    if (pthread_join(checkpoint_thread, NULL) != 0) {
+        perror("Error: failed to join checkpoint thread");
+        exit(EXIT_FAILURE);
+    }
+    running = 0;
+}
+
+
+/*
+ * Asks the checkpoint thread to take a checkpoint at its next wake up,
+ * even if nothing was logged. Safe to call from a signal handler.
+ */
+void checkpoint_request() {
+    __atomic_store_n(&requested, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Unmaps the loaded checkpoint, once the i-node table is destroyed.
+ */
+void checkpoint_close() {
+    for (int i = 0; i < num_loaded; i++)
+        munmap(loaded[i].data, loaded[i].size);
+    free(loaded);
+    loaded = NULL;
+    num_loaded = 0;
+}
@@ -0,0 +1,71 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Checkpoints of the namespace, written from a snapshot while commands
+ * keep running. The first one is a base image of every i-node in use and
+ * its directory; the next ones are deltas holding only the i-nodes that
+ * changed since the checkpoint before, and once the deltas pile up they
+ * are merged with the base into a new base (compaction).
+ * At startup the images are mapped and the directories are used in
+ * place, so only the pages that are touched are ever read; then only the
+ * log segments written after the last checkpoint are replayed.
+ * File contents are not part of the images.
+ */
+
+/* Names of the base image and of the deltas inside the data directory,
+ * and of an image being written */
+#define CHECKPOINT_FILE_NAME "checkpoint"
+#define CHECKPOINT_DELTA_FORMAT "checkpoint.%08lu"
+#define CHECKPOINT_TEMP_NAME "checkpoint.tmp"
+
+#define CHECKPOINT_MAGIC 0x54464350 /* "PCFT" */
+#define CHECKPOINT_VERSION 2
+
+/* A checkpoint is taken once the log grows this much since the last one */
+#define CHECKPOINT_LOG_SIZE (64UL << 20)
+/* or, if anything was logged, this many seconds after it */
+#define CHECKPOINT_PERIOD 60
+/* or within a second of checkpoint_request (the server calls it on SIGUSR1) */
+
+/* Deltas merged into the base once there are this many, or once they
+ * take more space than the base */
+#define CHECKPOINT_MAX_DELTAS 16
+
+/*
+ * Layout of an image: this header, the DirImage of each directory (each
+ * aligned to 8 bytes) and, at inodes_offset, a checkpoint_inode for each
+ * i-node it holds. A delta is named after its segment and applies on top
+ * of the base and the deltas with lower segments.
+ */
+typedef struct checkpoint_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segment;       /* first log segment not covered by the image */
+    int32_t num_inodes;     /* i-nodes in the image */
+    int32_t table_size;     /* one past the highest inumber in the image */
+    uint64_t inodes_offset;
+    uint64_t size;          /* of the whole image */
+} checkpoint_header;
+
+typedef struct checkpoint_inode {
+    int32_t inumber;
+    int32_t type;           /* T_NONE if it was deleted (deltas only) */
+    uint64_t dir_offset;    /* of the DirImage of a directory */
+} checkpoint_inode;
+
+/* Takes a checkpoint; called by the checkpoint thread */
+typedef void (*checkpoint_take)();
+
+/* Prototype functions of checkpoint.c */
+int checkpoint_write(char *dir, unsigned long segment, int dirty);
+int checkpoint_load(char *dir, unsigned long *segment);
+void checkpoint_start(char *dir, checkpoint_take take);
+void checkpoint_stop();
+void checkpoint_request();
+void checkpoint_close();
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <string.h>
+#include "state.h"
+#include "epoch.h"
+#include "dcache.h"
+
+/*
+ * A cached path. Entries are never changed once in the cache: a slot is
+ * pointed at a new entry, and the old one is retired, since lock-free
+ * readers may still be looking at it. The path follows the nodes.
+ */
+typedef struct dentry {
+    unsigned int hash;
+    int inumber;             /* FAIL for a path that does not exist */
+    int len;
+    int depth;
+    int parent;              /* for a path that does not exist */
+    unsigned int parent_gen;
+    dcache_node nodes[];
+} dentry;
+
+static dentry *dcache[DCACHE_SIZE];
+
+
+/*
+ * Returns the path of an entry.
+ */
+static const char *dentry_path(dentry *d) {
+    return (const char *) (d->nodes + d->depth);
+}
+
+
+/*
+ * Looks up a path in the cache.
+ * Input:
+ *  - path, len: full path
+ *  - inumber: set to the cached inumber (FAIL if the path does not exist)
+ * Returns: 1 on a valid hit, 0 otherwise
+ */
+int dcache_lookup(const char *path, int len, int *inumber) {
+    unsigned int hash = name_hash(path, len);
+    int hit = 0;
+
+    epoch_enter();
+    dentry *d = __atomic_load_n(&dcache[hash % DCACHE_SIZE], __ATOMIC_ACQUIRE);
+
+    if (d != NULL && d->hash == hash && d->len == len &&
+        memcmp(dentry_path(d), path, len) == 0) {
+        /* every node is still where it was when the path was resolved;
+         * the table never shrinks, so the inumbers are still in it */
+        hit = 1;
+        for (int i = 0; i < d->depth && hit; i++)
+            hit = inode_name_gen(d->nodes[i].inumber) == d->nodes[i].gen;
+        /* and nothing was added where the path stopped */
+        if (hit && d->inumber == FAIL)
+            hit = inode_child_gen(d->parent) == d->parent_gen;
+        if (hit)
+            *inumber = d->inumber;
+    }
+    epoch_exit();
+    return hit;
+}
+
+
+/*
+ * Starts the nodes of a path about to be resolved, at the root.
+ */
+void dcache_nodes_init(dcache_nodes *nodes) {
+    nodes->depth = 0;
+    nodes->parent = FS_ROOT;
+    nodes->parent_gen = inode_child_gen(FS_ROOT);
+}
+
+
+/*
+ * Adds the next node of a path being resolved. Must be called before
+ * the node is searched for the rest of the path.
+ * Input:
+ *  - nodes: the nodes so far
+ *  - inumber: the node
+ *  - gen: its name generation, read while it was known to be on the path
+ */
+void dcache_nodes_add(dcache_nodes *nodes, int inumber, unsigned int gen) {
+    nodes->nodes[nodes->depth].inumber = inumber;
+    nodes->nodes[nodes->depth].gen = gen;
+    nodes->depth++;
+    nodes->parent = inumber;
+    nodes->parent_gen = inode_child_gen(inumber);
+}
+
+
+/*
+ * Caches the result of resolving a path, replacing the entry in its
+ * slot. Nothing is cached if there is no memory for it.
+ * Input:
+ *  - path, len: full path
+ *  - inumber: inumber it resolved to, or FAIL
+ *  - nodes: the nodes it resolved to
+ */
+void dcache_insert(const char *path, int len, int inumber, dcache_nodes *nodes) {
+    if (inumber < 0 && inumber != FAIL)
+        return;
+
+    dentry *d = malloc(sizeof(dentry) + sizeof(dcache_node) * nodes->depth + len);
+    if (d == NULL)
+        return;
+    d->hash = name_hash(path, len);
+    d->inumber = inumber;
+    d->len = len;
+    d->depth = nodes->depth;
+    d->parent = nodes->parent;
+    d->parent_gen = nodes->parent_gen;
+    memcpy(d->nodes, nodes->nodes, sizeof(dcache_node) * nodes->depth);
+    memcpy((char *) dentry_path(d), path, len);
+
+    dentry *old = __atomic_exchange_n(&dcache[d->hash % DCACHE_SIZE], d, __ATOMIC_ACQ_REL);
+    if (old != NULL)
+        epoch_retire(old);
+}
+
+
+/*
+ * Frees every entry. No thread may be using the cache.
+ */
+void dcache_destroy() {
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        free(dcache[i]);
+        dcache[i] = NULL;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "state.h"
+
+/*
+ * Dentry cache: maps full paths to inumbers, including paths known not
+ * to exist, so that a repeated lookup is one hash probe instead of a
+ * walk of the tree.
+ * Entries are never removed; they go stale instead, and are replaced
+ * whole by the next path hashed to their slot. An entry keeps the name
+ * generation of every node along the path (see inode_renamed), which
+ * deletes and moves bump: a delete only makes the paths through the
+ * deleted node stale, and a move the paths through the moved node, that
+ * is, its subtree. An entry for a path that did not exist also keeps the
+ * child generation of the deepest node of the path that existed (see
+ * inode_child_gen), so it only goes stale when an entry is added to that
+ * directory.
+ */
+#define DCACHE_SIZE 4096
+
+/* A node of a path, with the name generation it had while on the path */
+typedef struct dcache_node {
+    int inumber;
+    unsigned int gen;
+} dcache_node;
+
+/*
+ * The nodes a path resolved to, below the root, and the deepest one
+ * with the child generation it had before it was searched.
+ */
+typedef struct dcache_nodes {
+    int depth;
+    int parent;
+    unsigned int parent_gen;
+    dcache_node nodes[MAX_PATH_DEPTH];
+} dcache_nodes;
+
+/* Prototype functions of dcache.c */
+int dcache_lookup(const char *path, int len, int *inumber);
+void dcache_nodes_init(dcache_nodes *nodes);
+void dcache_nodes_add(dcache_nodes *nodes, int inumber, unsigned int gen);
+void dcache_insert(const char *path, int len, int inumber, dcache_nodes *nodes);
+void dcache_destroy();
+
+#endif /* DCACHE_H */
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "epoch.h"
+
+/* Retired pointers are kept in one list per epoch, modulo 3 */
+#define LIMBO_LISTS 3
+
+/* Number of retires between attempts to advance the global epoch */
+#define ADVANCE_PERIOD 64
+
+
+/*
+ * Pointers retired by a thread during one epoch
+ */
+typedef struct limbo_list {
+    unsigned long epoch;
+    int size;
+    int capacity;
+    void **ptrs;
+} limbo_list;
+
+/*
+ * Per-thread epoch state. Records are never freed while the fs runs;
+ * the record of a finished thread is reused by the next new thread.
+ */
+typedef struct epoch_record {
+    unsigned long state; /* (epoch << 1) | 1 inside a read section, 0 outside */
+    int nesting;
+    int in_use;
+    int retired;         /* retires since the last advance attempt */
+    limbo_list limbo[LIMBO_LISTS];
+    struct epoch_record *next;
+} __attribute__((aligned(64))) epoch_record;
+
+
+static unsigned long global_epoch = LIMBO_LISTS;
+
+/* List of every record ever created */
+static epoch_record *records = NULL;
+
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record *my_record = NULL;
+
+
+/*
+ * Marks the record of a finishing thread as free for reuse.
+ */
+static void record_release(void *rec) {
+    __atomic_store_n(&((epoch_record *) rec)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void record_key_init() {
+    if ( pthread_key_create(&record_key, record_release) != 0 ) {
+        perror("Error: failed to create epoch key");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Returns the record of the calling thread, claiming one on first use.
+ */
+static epoch_record *record_get() {
+    epoch_record *rec;
+
+    if (my_record != NULL)
+        return my_record;
+
+    pthread_once(&record_key_once, record_key_init);
+
+    for (rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&rec->in_use, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (rec == NULL) {
+        if ( posix_memalign((void **) &rec, 64, sizeof(epoch_record)) != 0 ) {
+            perror("Error: failed to allocate epoch record");
+            exit(EXIT_FAILURE);
+        }
+        rec->state = 0;
+        rec->nesting = 0;
+        rec->in_use = 1;
+        rec->retired = 0;
+        for (int i = 0; i < LIMBO_LISTS; i++) {
+            rec->limbo[i].epoch = 0;
+            rec->limbo[i].size = 0;
+            rec->limbo[i].capacity = 0;
+            rec->limbo[i].ptrs = NULL;
+        }
+        rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &rec->next, rec, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(record_key, rec);
+    my_record = rec;
+    return rec;
+}
+
+
+/*
+ * Frees every pointer of a limbo list.
+ */
+static void limbo_flush(limbo_list *list) {
+    for (int i = 0; i < list->size; i++)
+        free(list->ptrs[i]);
+    list->size = 0;
+}
+
+
+/*
+ * Advances the global epoch if every thread inside a read section
+ * has already observed the current one.
+ */
+static void epoch_try_advance() {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    for (epoch_record *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL; rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch)
+            return;
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Starts a read section: memory retired from now on is not freed until
+ * the matching epoch_exit. Sections may be nested.
+ */
+void epoch_enter() {
+    epoch_record *rec = record_get();
+
+    if (rec->nesting++ == 0) {
+        unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_RELAXED);
+        __atomic_store_n(&rec->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+        /* the announcement must be visible before any shared read */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+
+/*
+ * Ends a read section.
+ */
+void epoch_exit() {
+    epoch_record *rec = my_record;
+
+    if (--rec->nesting == 0)
+        __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Frees a pointer once no read section can still reach it.
+ * The pointer must already be unreachable for new readers.
+ * Input:
+ *  - ptr: memory to free
+ */
+void epoch_retire(void *ptr) {
+    epoch_record *rec = record_get();
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    limbo_list *list = &rec->limbo[epoch % LIMBO_LISTS];
+
+    /* the list holds pointers retired at least 3 epochs ago: all are safe */
+    if (list->epoch != epoch) {
+        limbo_flush(list);
+        list->epoch = epoch;
+    }
+
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : ADVANCE_PERIOD;
+        list->ptrs = realloc(list->ptrs, sizeof(void *) * list->capacity);
+        if (list->ptrs == NULL) {
+            perror("Error: failed to grow limbo list");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->ptrs[list->size++] = ptr;
+
+    if (++rec->retired >= ADVANCE_PERIOD) {
+        rec->retired = 0;
+        epoch_try_advance();
+    }
+}
+
+
+/*
+ * Frees every retired pointer and the thread records.
+ * No thread may be inside a read section.
+ */
+void epoch_destroy() {
+    epoch_record *rec = records;
+
+    while (rec != NULL) {
+        epoch_record *next = rec->next;
+        for (int i = 0; i < LIMBO_LISTS; i++) {
+            limbo_flush(&rec->limbo[i]);
+            free(rec->limbo[i].ptrs);
+        }
+        free(rec);
+        rec = next;
+    }
+    records = NULL;
+    my_record = NULL;
+}
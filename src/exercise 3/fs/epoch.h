@@ -0,0 +1,16 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch based reclamation: memory that lock-free readers may still be
+ * looking at is retired instead of freed, and only released once every
+ * thread that was inside a read section at that time has left it.
+ */
+
+/* Prototype functions of epoch.c */
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr);
+void epoch_destroy();
+
+#endif /* EPOCH_H */
@@ -1,69 +1,168 @@
 #include "operations.h"
+#include "epoch.h"
+#include "brlock.h"
+#include "dcache.h"
+#include "wal.h"
+#include "checkpoint.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 
-pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
-
-pthread_cond_t canPrint = PTHREAD_COND_INITIALIZER, mustStop = PTHREAD_COND_INITIALIZER;
+/*
+ * Commands that change the fs's state (critical commands) hold the read
+ * side of the brlock, which only touches a per-thread shard. Commands
+ * that need the fs to be quiescent (print, moves of directories) take
+ * the write side.
+ */
 
-int state = UNDEFINED;
+// moves changing two directories right now, and moves done so far
+unsigned int renames_active = 0;
+unsigned int rename_gen = 0;
 
+// only one print or checkpoint (and its snapshot) runs at a time
+pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 
-// number of running critical commands (the ones that change the fs's state)
-int running_crit_cmds = 0;
+// directory of the log and checkpoints, NULL to keep the fs in memory
+static char *fs_data_dir = NULL;
 
 
-/* Given a path, fills pointers with strings for the parent path and child
- * file name
+/* Given a path, finds its parent path and child file name, without
+ * changing the path: the parent is the first parent_len bytes of it.
  * Input:
- *  - path: the path to split. ATENTION: the function may alter this parameter
- *  - parent: reference to a char*, to store parent path
+ *  - path: the path to split
+ *  - parent_len: reference to an int, to store the length of the parent path
  *  - child: reference to a char*, to store child file name
+ *  - child_len: reference to an int, to store the length of the child name
  */
-void split_parent_child_from_path(char * path, char ** parent, char ** child) {
+void split_parent_child_from_path(const char *path, int *parent_len,
+                                  const char **child, int *child_len) {
 
-	int n_slashes = 0, last_slash_location = 0;
-	int len = strlen(path);
+	int len = strlen(path), i;
 
 	// deal with trailing slash ( a/x vs a/x/ )
-	if (path[len-1] == '/') {
-		path[len-1] = '\0';
+	if (len > 0 && path[len-1] == '/') {
+		len--;
 	}
 
-	for (int i=0; i < len; ++i) {
-		if (path[i] == '/' && path[i+1] != '\0') {
-			last_slash_location = i;
-			n_slashes++;
-		}
+	for (i = len; i > 0 && path[i-1] != '/'; i--);
+
+	*child = path + i;
+	*child_len = len - i;
+	*parent_len = i > 0 ? i - 1 : 0; // root directory if there is no slash
+
+}
+
+
+/*
+ * Finds the next component of a path.
+ * Input:
+ *  - path: where to start looking
+ *  - end: end of the path
+ *  - len: reference to an int, to store the length of the component
+ * Returns: the component, or NULL if there are no more
+ */
+static const char *path_component(const char *path, const char *end, int *len) {
+	const char *c;
+
+	while (path < end && *path == '/')
+		path++;
+	if (path == end)
+		return NULL;
+
+	for (c = path; c < end && *c != '/'; c++);
+	*len = c - path;
+	return path;
+}
+
+
+/*
+ * Applies a record of the log while it is replayed.
+ */
+static void replay_record(wal_record *rec, char *path, char *new_path) {
+	int res = FAIL;
+
+	switch (rec->op) {
+		case WAL_CREATE:
+			res = create(path, rec->node_type);
+			break;
+		case WAL_DELETE:
+			res = delete(path);
+			break;
+		case WAL_MOVE:
+			res = move(path, new_path);
+			break;
 	}
+	if (res != SUCCESS)
+		printf("failed to replay log record %d for %s\n", rec->op, path);
+}
+
+
+/*
+ * Takes a checkpoint of the namespace. Critical commands are only held
+ * off while its snapshot starts, together with a new log segment, and
+ * while it ends; the image is written while they keep running.
+ */
+static void checkpoint_fs() {
+	unsigned long segment;
+	int dirty, res;
 
-	if (n_slashes == 0) { // root directory
-		*parent = "";
-		*child = path;
-		return;
+	if ( pthread_mutex_lock(&print_lock) != SUCCESS ) {
+		perror("Error: failed to lock");
+		exit(EXIT_FAILURE);
 	}
 
-	path[last_slash_location] = '\0';
-	*parent = path;
-	*child = path + last_slash_location + 1;
+	brlock_write_lock();
+	snapshot_begin();
+	dirty = inode_dirty_take();
+	segment = wal_rotate();
+	brlock_write_unlock();
+
+	res = checkpoint_write(fs_data_dir, segment, dirty);
+
+	brlock_write_lock();
+	snapshot_end();
+	brlock_write_unlock();
 
+	if ( pthread_mutex_unlock(&print_lock) != SUCCESS ) {
+		perror("Error: failed to unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the records before the snapshot are now in the checkpoint */
+	if (res == SUCCESS)
+		wal_remove_segments(segment);
 }
 
 
 /*
- * Initializes tecnicofs and creates root node.
+ * Initializes tecnicofs: restores it from the data directory, if there
+ * is one, or else creates the root node.
+ * Input:
+ *  - data_dir: directory of the checkpoint and the log, whose records
+ *              after the checkpoint are replayed, or NULL to keep the fs
+ *              only in memory
  */
-void init_fs() {
+void init_fs(char *data_dir) {
+	unsigned long segment = 0;
+
+	brlock_init();
 	inode_table_init();
+	fs_data_dir = data_dir;
 	
-	/* create root inode */
-	int root = inode_create(T_DIRECTORY, 'x');
-	
-	if (root != FS_ROOT) {
-		printf("failed to create node for tecnicofs root\n");
-		exit(EXIT_FAILURE);
+	if (data_dir == NULL || checkpoint_load(data_dir, &segment) == FAIL) {
+		/* create root inode */
+		int root = inode_create(T_DIRECTORY, 'x');
+		
+		if (root != FS_ROOT) {
+			printf("failed to create node for tecnicofs root\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (data_dir != NULL) {
+		wal_open(data_dir, segment, replay_record);
+		checkpoint_start(data_dir, checkpoint_fs);
 	}
 }
 
@@ -72,26 +171,26 @@ void init_fs() {
  * Destroy tecnicofs and inode table.
  */
 void destroy_fs() {
+	checkpoint_stop();
+	wal_close();
+	dcache_destroy();
 	inode_table_destroy();
+	checkpoint_close();
+	brlock_destroy();
 }
 
 
 /*
  * Checks if content of directory is not empty.
  * Input:
- *  - entries: entries of directory
+ *  - dir: entries of directory
  * Returns: SUCCESS or FAIL
  */
-int is_dir_empty(DirEntry *dirEntries) {
+int is_dir_empty(DirTable *dir) {
 
-	if (dirEntries == NULL) {
+	if (dir == NULL || dir->num_entries != 0) {
 		return FAIL;
 	}
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (dirEntries[i].inumber != FREE_INODE) {
-			return FAIL;
-		}
-	}
 	return SUCCESS;
 }
 
@@ -99,23 +198,22 @@ int is_dir_empty(DirEntry *dirEntries) {
 /*
  * Looks for node in directory entry from name.
  * Input:
- *  - name: path of node
- *  - entries: entries of directory
+ *  - name, len: name of node
+ *  - dir: entries of directory
  * Returns:
  *  - inumber: found node's inumber
  *  - FAIL: if not found
  */
-int lookup_sub_node(char *name, DirEntry *entries) {
+int lookup_sub_node(const char *name, int len, DirTable *dir) {
+	return dir_lookup_entry(dir, name, len);
+}
 
-	if (entries == NULL) {
-		return FAIL;
-	}	
-	for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-		if (entries[i].inumber != FREE_INODE && strcmp(entries[i].name, name) == 0) {
-            return entries[i].inumber;
-        }
-    }
-	return FAIL;
+
+/**
+ * Critical commands' first lines of code
+*/
+void crit_cmd_begin() {
+	brlock_read_lock();
 }
 
 
@@ -123,17 +221,7 @@ int lookup_sub_node(char *name, DirEntry *entries) {
  * Critical commands' last lines of code
 */
 void crit_cmd_end() {
-	running_crit_cmds--;
-	
-	if ( pthread_cond_broadcast(&canPrint) != 0 ) {
-		perror("Error: failed to broadcast");
-		exit(EXIT_FAILURE);
-	}
-
-	if ( pthread_mutex_unlock(&global_lock) != SUCCESS ) {
-		perror("Error: failed to unlock");
-		exit(EXIT_FAILURE);
-	}
+	brlock_read_unlock();
 }
 
 
@@ -146,40 +234,35 @@ void crit_cmd_end() {
  */
 int create(char *name, type nodeType){
 
-	if ( pthread_mutex_lock(&global_lock) != SUCCESS ) {
-		perror("Error: failed to lock");
-		exit(EXIT_FAILURE);
-	}
-	while (state == PRINTING)
-	{
-		if ( pthread_cond_wait(&mustStop,&global_lock) != SUCCESS ) {
-			perror("Error: failed to wait");
-			exit(EXIT_FAILURE);
-		}
-	}
-	running_crit_cmds++;
+	crit_cmd_begin();
 
 	
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	int parent_inumber, child_inumber, parent_len, child_len;
+	const char *child_name;
 	/* use for copy */
 	type pType;
 	union Data pdata;
-	save_locks* inodes_locks;
+	save_locks inodes_locks;
 
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	split_parent_child_from_path(name, &parent_len, &child_name, &child_len);
 
+	/* checked before an i-node is taken for it */
+	if (child_len == 0 || child_len >= MAX_FILE_NAME) {
+		printf("failed to create %s, invalid name\n", name);
+		
+		crit_cmd_end();
+		
+		return FAIL;
+	}
 
-	inodes_locks = lookup_commands(parent_name,'w');
-	parent_inumber = inodes_locks->inumber;
+	lookup_commands(name, parent_len, 'w', &inodes_locks);
+	parent_inumber = inodes_locks.inumber;
 
 	if (parent_inumber == FAIL) {
-		printf("failed to create %s, invalid parent dir %s\n",
-		        name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
-		free(inodes_locks);
+		printf("failed to create %s, invalid parent dir %.*s\n",
+		        name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		
 		crit_cmd_end();
 		
@@ -190,10 +273,9 @@ int create(char *name, type nodeType){
 
 
 	if(pType != T_DIRECTORY) {
-		printf("failed to create %s, parent %s is not a dir\n",
-		        name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
-		free(inodes_locks);
+		printf("failed to create %s, parent %.*s is not a dir\n",
+		        name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		
 		crit_cmd_end();
 		
@@ -201,11 +283,10 @@ int create(char *name, type nodeType){
 	}
 	
 
-	if (lookup_sub_node(child_name, pdata.dirEntries) != FAIL) {
-		printf("failed to create %s, already exists in dir %s\n",
-		       child_name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
-		free(inodes_locks);
+	if (lookup_sub_node(child_name, child_len, pdata.dir) != FAIL) {
+		printf("failed to create %.*s, already exists in dir %.*s\n",
+		       child_len, child_name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		
 		crit_cmd_end();
 		
@@ -215,31 +296,30 @@ int create(char *name, type nodeType){
 	/* create node and add entry to folder that contains new node */
 	child_inumber = inode_create(nodeType, 'w');
 	if (child_inumber == FAIL) {
-		printf("failed to create %s in  %s, couldn't allocate inode\n",
-		        child_name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
-		inode_unlock(child_inumber);
-		free(inodes_locks);
+		printf("failed to create %.*s in  %.*s, couldn't allocate inode\n",
+		        child_len, child_name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		
 		crit_cmd_end();
 		
 		return FAIL;
 	}
 	
-	if (dir_add_entry(parent_inumber, child_inumber, child_name) == FAIL) {
-		printf("could not add entry %s in dir %s\n",
-		       child_name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
+	if (dir_add_entry(parent_inumber, child_inumber, child_name, child_len) == FAIL) {
+		printf("could not add entry %.*s in dir %.*s\n",
+		       child_len, child_name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		inode_unlock(child_inumber);
-		free(inodes_locks);
+		/* no path leads to it */
+		inode_delete(child_inumber);
 		
 		crit_cmd_end();
 		
 		return FAIL;
 	}
-	unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
+	wal_log(WAL_CREATE, nodeType, name, NULL);
+	unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 	inode_unlock(child_inumber);
-	free(inodes_locks);
 	
 	crit_cmd_end();
 
@@ -254,38 +334,25 @@ int create(char *name, type nodeType){
  */
 int delete(char *name){
 	
-	if ( pthread_mutex_lock(&global_lock) != SUCCESS ) {
-		perror("Error: failed to lock");
-		exit(EXIT_FAILURE);
-	}
-	while (state == PRINTING)
-	{
-		if ( pthread_cond_wait(&mustStop,&global_lock) != SUCCESS ) {
-			perror("Error: failed to wait");
-			exit(EXIT_FAILURE);
-		}
-	}
-	running_crit_cmds++;
+	crit_cmd_begin();
 
-	int parent_inumber, child_inumber;
-	char *parent_name, *child_name, name_copy[MAX_FILE_NAME];
+	int parent_inumber, child_inumber, parent_len, child_len;
+	const char *child_name;
 	/* use for copy */
 	type pType, cType;
 	union Data pdata, cdata;
-	save_locks* inodes_locks;
+	save_locks inodes_locks;
 	
 
-	strcpy(name_copy, name);
-	split_parent_child_from_path(name_copy, &parent_name, &child_name);
+	split_parent_child_from_path(name, &parent_len, &child_name, &child_len);
 
-	inodes_locks = lookup_commands(parent_name,'w');
-	parent_inumber = inodes_locks->inumber;
+	lookup_commands(name, parent_len, 'w', &inodes_locks);
+	parent_inumber = inodes_locks.inumber;
 
 	if (parent_inumber == FAIL) {
-		printf("failed to delete %s, invalid parent dir %s\n",
-		        child_name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
-		free(inodes_locks);
+		printf("failed to delete %.*s, invalid parent dir %.*s\n",
+		        child_len, child_name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		
 		crit_cmd_end();
 		
@@ -295,23 +362,21 @@ int delete(char *name){
 	inode_get(parent_inumber, &pType, &pdata);
 
 	if(pType != T_DIRECTORY) {
-		printf("failed to delete %s, parent %s is not a dir\n",
-		        child_name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
-		free(inodes_locks);
+		printf("failed to delete %.*s, parent %.*s is not a dir\n",
+		        child_len, child_name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		
 		crit_cmd_end();
 		
 		return FAIL;
 	}
 
-	child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
+	child_inumber = lookup_sub_node(child_name, child_len, pdata.dir);
 
 	if (child_inumber == FAIL) {
-		printf("could not delete %s, does not exist in dir %s\n",
-		       name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
-		free(inodes_locks);
+		printf("could not delete %s, does not exist in dir %.*s\n",
+		       name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		
 		crit_cmd_end();
 		
@@ -321,25 +386,33 @@ int delete(char *name){
 	inode_lock(child_inumber,'w');
 	inode_get(child_inumber, &cType, &cdata);
 	
-	if (cType == T_DIRECTORY && is_dir_empty(cdata.dirEntries) == FAIL) {
+	if (cType == T_DIRECTORY && is_dir_empty(cdata.dir) == FAIL) {
 		printf("could not delete %s: is a directory and not empty\n",
 		       name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		inode_unlock(child_inumber);
-		free(inodes_locks);
 		
 		crit_cmd_end();
 		
 		return FAIL;
 	}
+
+	if (inode_is_open(child_inumber)) {
+		printf("could not delete %s: file is open\n", name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
+		inode_unlock(child_inumber);
+		
+		crit_cmd_end();
+		
+		return TECNICOFS_ERROR_FILE_IS_OPEN;
+	}
 	
 	/* remove entry from folder that contained deleted node */
-	if (dir_reset_entry(parent_inumber, child_inumber) == FAIL) {
-		printf("failed to delete %s from dir %s\n",
-		       child_name, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
+	if (dir_reset_entry(parent_inumber, child_inumber, child_name, child_len) == FAIL) {
+		printf("failed to delete %.*s from dir %.*s\n",
+		       child_len, child_name, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		inode_unlock(child_inumber);
-		free(inodes_locks);
 		
 		crit_cmd_end();
 		
@@ -347,20 +420,19 @@ int delete(char *name){
 	}
 
 	if (inode_delete(child_inumber) == FAIL) {
-		printf("could not delete inode number %d from dir %s\n",
-		       child_inumber, parent_name);
-		unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
+		printf("could not delete inode number %d from dir %.*s\n",
+		       child_inumber, parent_len, name);
+		unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 		inode_unlock(child_inumber);
-		free(inodes_locks);
 		
 		
 		crit_cmd_end();
 		
 		return FAIL;
 	}
-	unlock_all_nodes(inodes_locks->locks_numbers,inodes_locks->num_locks);
+	wal_log(WAL_DELETE, T_NONE, name, NULL);
+	unlock_all_nodes(inodes_locks.locks_numbers,inodes_locks.num_locks);
 	inode_unlock(child_inumber);
-	free(inodes_locks);
 
 	crit_cmd_end();
 	
@@ -368,6 +440,84 @@ int delete(char *name){
 }
 
 
+/*
+ * Lookup for a given path that takes no locks: each directory is read
+ * optimistically and validated against its sequence number.
+ * Input:
+ *  - name, len: path of node
+ *  - nodes: filled with the nodes found, for the dentry cache
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ *    RETRY: if a concurrent change was seen
+ */
+int lookup_optimistic(const char *name, int len, dcache_nodes *nodes) {
+	const char *end = name + len;
+	int clen;
+
+	/* a move may change the path under the walk */
+	unsigned int rgen = __atomic_load_n(&rename_gen, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&renames_active, __ATOMIC_ACQUIRE) != 0)
+		return RETRY;
+
+	epoch_enter();
+
+	/* start at root node */
+	int current_inumber = FS_ROOT;
+	unsigned int seq = inode_read_begin(current_inumber);
+	unsigned int name_gen;
+
+	const char *path = path_component(name, end, &clen);
+	dcache_nodes_init(nodes);
+
+	/* search for all sub nodes */
+	while (path != NULL && current_inumber >= 0) {
+		current_inumber = inode_lookup_optimistic(current_inumber, &seq, path, clen, &name_gen);
+		if (current_inumber >= 0)
+			dcache_nodes_add(nodes, current_inumber, name_gen);
+		path = path_component(path + clen, end, &clen);
+	}
+
+	epoch_exit();
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&renames_active, __ATOMIC_ACQUIRE) != 0 ||
+	    __atomic_load_n(&rename_gen, __ATOMIC_RELAXED) != rgen)
+		return RETRY;
+	return current_inumber;
+}
+
+
+/*
+ * Lookup for the first len bytes of a path. Tries the dentry cache, then
+ * the lock-free walk, and falls back to read locking the path when it
+ * keeps seeing concurrent changes.
+ * Input:
+ *  - name, len: path of node
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup_path(const char *name, int len) {
+	int inumber;
+
+	if (dcache_lookup(name, len, &inumber))
+		return inumber;
+
+	dcache_nodes nodes;
+	for (int i = 0; i < OPTIMISTIC_TRIES; i++) {
+		inumber = lookup_optimistic(name, len, &nodes);
+		if (inumber != RETRY)
+			break;
+	}
+	if (inumber == RETRY)
+		inumber = lookup_locked(name, len, &nodes);
+
+	dcache_insert(name, len, inumber, &nodes);
+	return inumber;
+}
+
+
 /*
  * Lookup for a given path.
  * Input:
@@ -377,11 +527,37 @@ int delete(char *name){
  *     FAIL: otherwise
  */
 int lookup(char *name) {
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-	int count = 0;
-	save_locks* slocks = (save_locks*) malloc(sizeof(struct save_locks));
-	strcpy(full_path, name);
+	return lookup_path(name, strlen(name));
+}
+
+
+/*
+ * Fills the nodes of a path for the dentry cache, from its locks. Must be
+ * called while they are held, so no entry is added to them meanwhile.
+ * Input:
+ *  - locks_numbers, count: the nodes locked along the path, from the root
+ *  - nodes: filled with the nodes below the root
+ */
+static void locked_nodes(int *locks_numbers, int count, dcache_nodes *nodes) {
+	dcache_nodes_init(nodes);
+	for (int i = 1; i < count; i++)
+		dcache_nodes_add(nodes, locks_numbers[i], inode_name_gen(locks_numbers[i]));
+}
+
+
+/*
+ * Lookup for a given path, read locking every node along it.
+ * Input:
+ *  - name, len: path of node
+ *  - nodes: filled with the nodes found, for the dentry cache
+ * Returns:
+ *  inumber: identifier of the i-node, if found
+ *     FAIL: otherwise
+ */
+int lookup_locked(const char *name, int len, dcache_nodes *nodes) {
+	const char *end = name + len;
+	int count = 0, clen;
+	int locks_numbers[MAX_PATH_DEPTH];
 
 	/* start at root node */
 	int current_inumber = FS_ROOT;
@@ -389,249 +565,461 @@ int lookup(char *name) {
 	/* use for copy */
 	type nType;
 	union Data data;
-	char *saveptr;
 
 	/* get root inode data */
 	inode_lock(current_inumber,'r');
-	slocks->locks_numbers[count] = current_inumber;
+	locks_numbers[count] = current_inumber;
 	count++;
-	slocks->inumber = current_inumber;
 	inode_get(current_inumber, &nType, &data);
 
-	char *path = strtok_r(full_path, delim,&saveptr);
+	const char *path = path_component(name, end, &clen);
 
 	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
+	while (path != NULL && (current_inumber = lookup_sub_node(path, clen, nType == T_DIRECTORY ? data.dir : NULL)) != FAIL) {
 		inode_lock(current_inumber, 'r');
-		slocks->locks_numbers[count] = current_inumber;
+		locks_numbers[count] = current_inumber;
 		count++;
-		slocks->inumber = current_inumber;
 		inode_get(current_inumber, &nType, &data);
-		path = strtok_r(NULL, delim,&saveptr);
+		path = path_component(path + clen, end, &clen);
 	}
-	unlock_all_nodes(slocks->locks_numbers,count);
-	free(slocks);
+	locked_nodes(locks_numbers, count, nodes);
+	unlock_all_nodes(locks_numbers,count);
 
 	return current_inumber;
 }
 
-int lookupmove(char *name) {
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-	strcpy(full_path, name);
-
-	/* start at root node */
-	int current_inumber = FS_ROOT;
+/*
+ * Continues a locked walk: read locks every node along a path below a
+ * locked node, and the last one with ltype.
+ * Input:
+ *  - inumber: locked node where the path starts
+ *  - name, end: the path, relative to that node
+ *  - ltype: type of the lock used in the last inode of the path
+ *  - slocks: the locks aqquired are added to it
+ * Returns: inumber of the last node, or FAIL if not found
+ */
+static int lock_path_from(int inumber, const char *name, const char *end,
+                          char ltype, save_locks *slocks) {
+	int current_inumber = inumber, clen, next_len;
 
 	/* use for copy */
 	type nType;
 	union Data data;
-	char *saveptr;
+	const char *path = path_component(name, end, &clen);
 
-	/* get root inode data */
 	inode_get(current_inumber, &nType, &data);
 
-	char *path = strtok_r(full_path, delim,&saveptr);
-
 	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
+	while (path != NULL && (current_inumber = lookup_sub_node(path, clen, nType == T_DIRECTORY ? data.dir : NULL)) != FAIL) {
+		const char *next = path_component(path + clen, end, &next_len);
+		if ( next != NULL )
+		{
+			inode_lock(current_inumber, 'r');
+		}
+		else
+		{
+			inode_lock(current_inumber,ltype);
+		}
+		slocks->locks_numbers[slocks->num_locks] = current_inumber;
+		slocks->num_locks++;
 		inode_get(current_inumber, &nType, &data);
-		path = strtok_r(NULL, delim,&saveptr);
+		path = next;
+		clen = next_len;
 	}
 	return current_inumber;
 }
 
 
-
 /*
- * Lookup for a given path used in a command i.e delete,move or destroy.
+ * Locks every node along a path, from the root: read locks, except for
+ * the last node, locked with ltype.
  * Input:
- *  - name: path of node
+ *  - name, end: the path
  *  - ltype: type of the lock used in the last inode of the path
- * Returns:
- *  current_inumber: structure that contains all the locks aqquired within the command,the name's inumber 
- * 					 and the total amount of locks aqquired  
- *     FAIL: otherwise
+ *  - slocks: filled with the locks aqquired
+ * Returns: inumber of the last node, or FAIL if not found
  */
-save_locks* lookup_commands(char *name, char ltype) {
-	char full_path[MAX_FILE_NAME];
-	char delim[] = "/";
-	int count = 0;
-	save_locks* slocks = (save_locks*) malloc(sizeof(struct save_locks));
-	strcpy(full_path, name);
-
-	/* start at root node */
-	int current_inumber = FS_ROOT;
-
-	/* use for copy */
-	type nType;
-	union Data data;
-	char *saveptr;
+static int lock_path(const char *name, const char *end, char ltype, save_locks *slocks) {
+	int clen;
 
 	/* get root inode data */
-	if ( strcmp(name, "") == 0) {
-		inode_lock(current_inumber, ltype);
+	if ( path_component(name, end, &clen) == NULL ) {
+		inode_lock(FS_ROOT, ltype);
 	} else {
-		inode_lock(current_inumber,'r');
+		inode_lock(FS_ROOT,'r');
 	}
-	
-	slocks->locks_numbers[count] = current_inumber;
-	count++;
-	slocks->inumber = current_inumber;
-	inode_get(current_inumber, &nType, &data);
+	slocks->locks_numbers[0] = FS_ROOT;
+	slocks->num_locks = 1;
 
-	char *path = strtok_r(full_path, delim, &saveptr);
+	return lock_path_from(FS_ROOT, name, end, ltype, slocks);
+}
 
-	/* search for all sub nodes */
-	while (path != NULL && (current_inumber = lookup_sub_node(path, data.dirEntries)) != FAIL) {
-		if ( strcmp("", saveptr) != 0 )
-		{
-			inode_lock(current_inumber, 'r');
-			slocks->locks_numbers[count] = current_inumber;
-			count++;
-			slocks->inumber = current_inumber;
-			inode_get(current_inumber, &nType, &data);
-			path = strtok_r(NULL, delim, &saveptr);
+
+/*
+ * Lookup for a given path used in a command i.e delete,move or destroy.
+ * Input:
+ *  - name, len: path of node, which may be the start of a longer path
+ *  - ltype: type of the lock used in the last inode of the path
+ *  - slocks: filled with all the locks aqquired within the command, the name's
+ *            inumber (FAIL if not found) and the total amount of locks aqquired
+ */
+void lookup_commands(const char *name, int len, char ltype, save_locks *slocks) {
+	dcache_nodes nodes;
+	int cached;
+
+	/*
+	 * A cached node only needs its own lock: its ancestors can't be
+	 * deleted while it exists and moves of directories don't run along
+	 * critical commands (moves of files don't change any other path).
+	 * A delete bumps the node's name generation before unlocking it, so
+	 * an entry still valid once the lock is held means it is still there.
+	 */
+	if (dcache_lookup(name, len, &cached)) {
+		if (cached == FAIL) {
+			slocks->inumber = FAIL;
+			slocks->num_locks = 0;
+			return;
 		}
-		else
-		{
-			inode_lock(current_inumber,ltype);
-			slocks->locks_numbers[count] = current_inumber;
-			count++;
-			slocks->inumber = current_inumber;
-			inode_get(current_inumber, &nType, &data);
-			path = strtok_r(NULL, delim,&saveptr);
+		inode_lock(cached, ltype);
+		int again;
+		if (dcache_lookup(name, len, &again) && again == cached) {
+			slocks->inumber = cached;
+			slocks->locks_numbers[0] = cached;
+			slocks->num_locks = 1;
+			return;
 		}
+		inode_unlock(cached);
 	}
-	slocks->num_locks = count;
-	return slocks;
+
+	slocks->inumber = lock_path(name, name + len, ltype, slocks);
+	locked_nodes(slocks->locks_numbers, slocks->num_locks, &nodes);
+	dcache_insert(name, len, slocks->inumber, &nodes);
 }
 
 
 /*
- * Move a file from it's current directory to a given directory.
+ * Moves a node with the brlock held: locks the paths to both parents,
+ * read locking them down to their deepest common directory and write
+ * locking the parents. Below the common directory the two paths are in
+ * different subtrees, which are locked in the order of the inumbers of
+ * their first nodes, so two moves never wait for each other.
  * Input:
  *  - current_path: path of node
  *  - new_path: new path of the node
+ *  - exclusive: whether the write side of the brlock is held
  * Returns:
- *     SUCCESS or FAIL
+ *     SUCCESS, FAIL, or RETRY for a directory when not exclusive
  */
-int move(char current_path[], char new_path[])
+static int move_locked(char *current_path, char *new_path, int exclusive)
 {
-	if ( pthread_mutex_lock(&global_lock) != SUCCESS ) {
-		perror("Error: failed to lock");
-		exit(EXIT_FAILURE);
+	// variables
+	const char *child_name, *new_child_name;
+	int parent_len, child_len, new_parent_len, new_child_len;
+	int parent_inumber, child_inumber, new_parent_inumber, common_inumber;
+	save_locks locks, new_locks;
+	int res = FAIL;
+
+	/* use for copy */
+	type pType, cType;
+	union Data pdata;
+
+	split_parent_child_from_path(current_path, &parent_len, &child_name, &child_len);
+	split_parent_child_from_path(new_path, &new_parent_len, &new_child_name, &new_child_len);
+	if (new_child_len == 0 || new_child_len >= MAX_FILE_NAME) {
+		printf("failed to move %s, invalid name %s\n", current_path, new_path);
+		return FAIL;
 	}
-	while (state == PRINTING)
-	{
-		if ( pthread_cond_wait(&mustStop,&global_lock) != SUCCESS ) {
-			perror("Error: failed to wait");
-			exit(EXIT_FAILURE);
+
+	// finds the deepest directory common to both parent paths
+	const char *end = current_path + parent_len, *new_end = new_path + new_parent_len;
+	const char *common = current_path, *new_common = new_path;
+	const char *c, *nc;
+	int clen, nclen;
+	while ((c = path_component(common, end, &clen)) != NULL &&
+	       (nc = path_component(new_common, new_end, &nclen)) != NULL &&
+	       clen == nclen && memcmp(c, nc, clen) == 0) {
+		common = c + clen;
+		new_common = nc + nclen;
+	}
+	int is_parent = path_component(common, end, &clen) == NULL ||
+	                path_component(new_common, new_end, &nclen) == NULL;
+
+	common_inumber = lock_path(current_path, common, is_parent ? 'w' : 'r', &locks);
+	new_locks.num_locks = 0;
+	parent_inumber = new_parent_inumber = common_inumber;
+
+	if (common_inumber != FAIL && !is_parent) {
+		// locks the subtree whose first node has the lowest inumber first
+		inode_get(common_inumber, &pType, &pdata);
+		c = path_component(common, end, &clen);
+		nc = path_component(new_common, new_end, &nclen);
+		int first = lookup_sub_node(c, clen, pType == T_DIRECTORY ? pdata.dir : NULL);
+		int new_first = lookup_sub_node(nc, nclen, pType == T_DIRECTORY ? pdata.dir : NULL);
+
+		if (first == FAIL || new_first == FAIL) {
+			parent_inumber = first;
+			new_parent_inumber = new_first;
+		}
+		else if (first < new_first) {
+			parent_inumber = lock_path_from(common_inumber, common, end, 'w', &locks);
+			new_parent_inumber = lock_path_from(common_inumber, new_common, new_end, 'w', &new_locks);
+		}
+		else {
+			new_parent_inumber = lock_path_from(common_inumber, new_common, new_end, 'w', &new_locks);
+			parent_inumber = lock_path_from(common_inumber, common, end, 'w', &locks);
 		}
 	}
-	running_crit_cmds++;
+	else if (common_inumber != FAIL) {
+		if (path_component(common, end, &clen) != NULL)
+			parent_inumber = lock_path_from(common_inumber, common, end, 'w', &locks);
+		if (path_component(new_common, new_end, &nclen) != NULL)
+			new_parent_inumber = lock_path_from(common_inumber, new_common, new_end, 'w', &locks);
+	}
 
-	int cp_inumber, nw_inumber;
-	if ((cp_inumber = lookup(current_path)) != FAIL && (nw_inumber = lookup(new_path)) == FAIL)
-	{
-		// variables
-		char *parent_name, *child_name, *new_parent_name, *useless;
-		char current_path_copy[MAX_FILE_NAME], new_path_copy[MAX_FILE_NAME];
-		int parent_inumber, child_inumber;
-		int new_parent_inumber;
-		
-		/* use for copy */
-		type pType;
-		union Data pdata;
-		
-		// gets parent and child's inumbers
-		
-		strcpy(current_path_copy, current_path);
-		split_parent_child_from_path(current_path_copy, &parent_name, &child_name);
-		parent_inumber = lookupmove(parent_name);
-		if ( parent_inumber == FAIL ) {
-			printf("failed to move %s, invalid parent dir %s\n",
-		        current_path, parent_name);
-			
-			crit_cmd_end();
-			
-			return FAIL;
+	// checks both parents and the child
+	if ( parent_inumber == FAIL ) {
+		printf("failed to move %s, invalid parent dir %.*s\n",
+		        current_path, parent_len, current_path);
+		goto out;
+	}
+	inode_get(parent_inumber, &pType, &pdata);
+	if ( pType != T_DIRECTORY ) {
+		printf("failed to move %s, parent %.*s is not a dir\n",
+		        current_path, parent_len, current_path);
+		goto out;
+	}
+	child_inumber = lookup_sub_node(child_name, child_len, pdata.dir);
+	if ( child_inumber == FAIL ) {
+		printf("failed to move %s, does not exist\n", current_path);
+		goto out;
+	}
+
+	if ( new_parent_inumber == FAIL ) {
+		printf("failed to move %.*s, invalid new parent dir %.*s\n",
+		        child_len, child_name, new_parent_len, new_path);
+		goto out;
+	}
+	inode_get(new_parent_inumber, &pType, &pdata);
+	if ( pType != T_DIRECTORY ) {
+		printf("failed to move %.*s, new parent %.*s is not a dir\n",
+		        child_len, child_name, new_parent_len, new_path);
+		goto out;
+	}
+	if ( lookup_sub_node(new_child_name, new_child_len, pdata.dir) != FAIL ) {
+		printf("failed to move %s, %s already exists\n", current_path, new_path);
+		goto out;
+	}
+
+	/*
+	 * Moving a directory changes the path of every node below it, which
+	 * critical commands using the dentry cache don't lock: it is done
+	 * alone. Its new parent must not be below it.
+	 */
+	inode_get(child_inumber, &cType, NULL);
+	if ( cType == T_DIRECTORY ) {
+		if (!exclusive) {
+			res = RETRY;
+			goto out;
 		}
-		inode_get(parent_inumber, &pType, &pdata);
-		if ( pType != T_DIRECTORY ) {
-			printf("failed to move %s, parent %s is not a dir\n",
-		        current_path, parent_name);
-			
-			crit_cmd_end();
-			
-			return FAIL;
+		for (int i = 0; i < locks.num_locks + new_locks.num_locks; i++) {
+			int inumber = i < locks.num_locks ? locks.locks_numbers[i]
+			                                  : new_locks.locks_numbers[i - locks.num_locks];
+			if (inumber == child_inumber) {
+				printf("failed to move %s, %s is inside it\n", current_path, new_path);
+				goto out;
+			}
 		}
-		child_inumber = lookup_sub_node(child_name, pdata.dirEntries);
-		
-		// gets new parent inumber
-		strcpy(new_path_copy, new_path);
-		split_parent_child_from_path(new_path_copy, &new_parent_name, &useless);
+	}
 
-		new_parent_inumber = lookupmove(new_parent_name);
-		
-		if ( new_parent_inumber == FAIL ) {
-			printf("failed to move %s, invalid new parent dir %s\n",
-		        child_name, new_parent_name);
-			
-			crit_cmd_end();
-			
-			return FAIL;
-		}
+	// adds the entry to the new parent's directory and removes it from the parent's directory
+	__atomic_add_fetch(&renames_active, 1, __ATOMIC_SEQ_CST);
+	res = dir_add_entry(new_parent_inumber, child_inumber, new_child_name, new_child_len);
+	if (res == SUCCESS) {
+		dir_reset_entry(parent_inumber, child_inumber, child_name, child_len);
+		inode_renamed(child_inumber);
+			wal_log(WAL_MOVE, T_NONE, current_path, new_path);
+		__atomic_add_fetch(&rename_gen, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_sub_fetch(&renames_active, 1, __ATOMIC_RELEASE);
 
-		inode_get(new_parent_inumber, &pType, &pdata);
-		
-		if ( pType != T_DIRECTORY ) {
-			printf("failed to move %s, new parent %s is not a dir\n",
-		        child_name, new_parent_name);
-			
-			crit_cmd_end();
-			
-			return FAIL;
-		}
-		
-		// removes entry from parent's dirEntries and adds it to the new parent's dirEntries
-		dir_add_entry(new_parent_inumber, child_inumber, child_name);
-		dir_reset_entry(parent_inumber, child_inumber);
-		
-		// unlocks all locked nodes
-		crit_cmd_end();
-		
-		return SUCCESS;
+out:
+	// unlocks all locked nodes
+	unlock_all_nodes(new_locks.locks_numbers, new_locks.num_locks);
+	unlock_all_nodes(locks.locks_numbers, locks.num_locks);
+	return res;
+}
+
+
+/*
+ * Move a node from it's current directory to a given directory.
+ * Runs along other critical commands, except when moving a directory.
+ * Input:
+ *  - current_path: path of node
+ *  - new_path: new path of the node
+ * Returns:
+ *     SUCCESS or FAIL
+ */
+int move(char current_path[], char new_path[])
+{
+	int res;
+
+	crit_cmd_begin();
+	res = move_locked(current_path, new_path, 0);
+	crit_cmd_end();
+
+	if (res == RETRY) {
+		brlock_write_lock();
+		res = move_locked(current_path, new_path, 1);
+		brlock_write_unlock();
 	}
-	else
-	{
-		crit_cmd_end();
-		
-		return FAIL;
+	return res;
+}
+
+
+/*
+ * Opens a file given a path, taking a reference to its i-node: the file
+ * cannot be deleted until close_file.
+ * Input:
+ *  - name: path of the file
+ * Returns:
+ *  inumber: identifier of the file's i-node, used by the other file commands
+ *     FAIL: if there is no such file
+ */
+int open_file(char *name) {
+	save_locks inodes_locks;
+	type nType = T_NONE;
+	int inumber;
+
+	/*
+	 * The reference is taken while the path is still locked, so it is
+	 * the node at that path that is opened; a delete checks for open
+	 * descriptors with the i-node write locked.
+	 */
+	crit_cmd_begin();
+	lookup_commands(name, strlen(name), 'r', &inodes_locks);
+	inumber = inodes_locks.inumber;
+	if (inumber >= 0) {
+		inode_get(inumber, &nType, NULL);
+		if (nType == T_FILE)
+			inode_open(inumber);
 	}
+	unlock_all_nodes(inodes_locks.locks_numbers, inodes_locks.num_locks);
+	crit_cmd_end();
+	return nType == T_FILE ? inumber : FAIL;
+}
+
+
+/*
+ * Closes a file opened with open_file.
+ * Input:
+ *  - inumber: identifier of the file's i-node
+ */
+void close_file(int inumber) {
+	inode_close(inumber);
+}
+
+
+/*
+ * Reads from an open file.
+ * Input:
+ *  - inumber: identifier of the file's i-node, as returned by open_file
+ *  - buf: where to store the bytes read
+ *  - len: number of bytes to read
+ *  - offset: position of the first byte
+ * Returns: number of bytes read, or FAIL
+ */
+int read_file(int inumber, char *buf, size_t len, size_t offset) {
+	int res;
+
+	inode_lock(inumber, 'r');
+	res = inode_file_read(inumber, buf, len, offset);
+	inode_unlock(inumber);
+	return res;
+}
+
+
+/*
+ * Writes to an open file.
+ * Input:
+ *  - inumber: identifier of the file's i-node
+ *  - buf: bytes to write
+ *  - len: number of bytes to write
+ *  - offset: position of the first byte
+ * Returns: number of bytes written, or FAIL
+ */
+int write_file(int inumber, char *buf, size_t len, size_t offset) {
+	int res;
+
+	crit_cmd_begin();
+	inode_lock(inumber, 'w');
+	res = inode_file_write(inumber, buf, len, offset);
+	inode_unlock(inumber);
+	crit_cmd_end();
+	return res;
+}
+
+
+/*
+ * Writes at the end of an open file.
+ * Input:
+ *  - inumber: identifier of the file's i-node
+ *  - buf: bytes to write
+ *  - len: number of bytes to write
+ * Returns: number of bytes written, or FAIL
+ */
+int append_file(int inumber, char *buf, size_t len) {
+	int res = FAIL;
+	size_t size;
+
+	crit_cmd_begin();
+	inode_lock(inumber, 'w');
+	if (inode_file_size(inumber, &size) == SUCCESS)
+		res = inode_file_write(inumber, buf, len, size);
+	inode_unlock(inumber);
+	crit_cmd_end();
+	return res;
+}
+
+
+/*
+ * Sets the size of an open file.
+ * Input:
+ *  - inumber: identifier of the file's i-node
+ *  - size: new size
+ * Returns: SUCCESS or FAIL
+ */
+int truncate_file(int inumber, size_t size) {
+	int res;
+
+	crit_cmd_begin();
+	inode_lock(inumber, 'w');
+	res = inode_file_truncate(inumber, size);
+	inode_unlock(inumber);
+	crit_cmd_end();
+	return res;
 }
 
 
 /*
  * Prints tecnicofs tree.
+ * Critical commands are only held off while the snapshot starts and ends;
+ * the tree is walked and written while they keep running.
  * Input:
  *  - filename: name of file
  */
 int print_tecnicofs_tree(char *filename){
 	int res;
 	FILE *fp;
-	if ( pthread_mutex_lock(&global_lock) != SUCCESS ) {
+
+	if ( pthread_mutex_lock(&print_lock) != SUCCESS ) {
 		perror("Error: failed to lock");
 		exit(EXIT_FAILURE);
 	}
-	while ( running_crit_cmds != 0 )
-	{
-		if ( pthread_cond_wait(&canPrint,&global_lock) != SUCCESS ) {
-			perror("Error: failed to wait");
-			exit(EXIT_FAILURE);
-		}
-	}
-	state = PRINTING;
+
+	/* the snapshot starts at a point where no critical command is running */
+	brlock_write_lock();
+	snapshot_begin();
+	brlock_write_unlock();
 	
 	if ( (fp = fopen(filename, "w")) == NULL ) {
 		perror("Print: failed to open file");
@@ -645,12 +1033,11 @@ int print_tecnicofs_tree(char *filename){
 		exit(EXIT_FAILURE);
 	}
 	
-	state = NOTPRINTING;
-	if ( pthread_cond_broadcast(&mustStop) != SUCCESS ) {
-		perror("Error: failed to broadcast");
-		exit(EXIT_FAILURE);
-	}
-	if ( pthread_mutex_unlock(&global_lock) != SUCCESS ) {
+	brlock_write_lock();
+	snapshot_end();
+	brlock_write_unlock();
+
+	if ( pthread_mutex_unlock(&print_lock) != SUCCESS ) {
 		perror("Error: failed to unlock");
 		exit(EXIT_FAILURE);
 	}
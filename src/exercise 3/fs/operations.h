@@ -1,18 +1,29 @@
 #ifndef FS_H
 #define FS_H
 #include "state.h"
+#include "dcache.h"
 
-enum flags{PRINTING, NOTPRINTING, UNDEFINED};
+/* Lock-free attempts of a lookup before it falls back to locking the path */
+#define OPTIMISTIC_TRIES 3
 
 /* Prototype functions of operations.c*/
-void init_fs();
+void init_fs(char *data_dir);
 void destroy_fs();
-int is_dir_empty(DirEntry *dirEntries);
+int is_dir_empty(DirTable *dir);
 int create(char *name, type nodeType);
 int delete(char *name);
 int lookup(char *name);
+int lookup_path(const char *name, int len);
+int lookup_optimistic(const char *name, int len, dcache_nodes *nodes);
+int lookup_locked(const char *name, int len, dcache_nodes *nodes);
 int move(char *current_path, char *new_path);
 int print_tecnicofs_tree(char *fp);
-save_locks* lookup_commands(char *name,char ltype);
+int open_file(char *name);
+void close_file(int inumber);
+int read_file(int inumber, char *buf, size_t len, size_t offset);
+int write_file(int inumber, char *buf, size_t len, size_t offset);
+int append_file(int inumber, char *buf, size_t len);
+int truncate_file(int inumber, size_t size);
+void lookup_commands(const char *name, int len, char ltype, save_locks *slocks);
 
 #endif /* FS_H */
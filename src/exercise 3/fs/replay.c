@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "replay.h"
+#include "state.h"
+
+/* Kinds of keys: a node, or the entries of a directory */
+#define KEY_NODE 0
+#define KEY_ENTRIES 1
+
+/*
+ * What the records replayed so far did to a node or to the entries of a
+ * directory: the last record that changed it and the records that needed
+ * it to stay put since.
+ */
+typedef struct replay_key {
+    const char *path; /* normalized, NULL for an unused slot */
+    int len;
+    int kind;
+    unsigned int hash;
+    int writer;
+    int num_readers;
+    int readers_size;
+    int *readers;
+} replay_key;
+
+/* Open-addressed table of the keys */
+static replay_key *keys;
+static int keys_size;
+static int num_keys;
+
+/* Records ready to be replayed, and how many were replayed */
+static int *ready;
+static int num_ready;
+static int num_done;
+static int num_items;
+static replay_item *items;
+static wal_apply apply_record;
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Appends an int to a growing array.
+ */
+static void int_push(int **array, int *num, int *size, int value) {
+    if (*num == *size) {
+        *size = *size > 0 ? 2 * *size : 4;
+        if ((*array = realloc(*array, sizeof(int) * *size)) == NULL) {
+            perror("Error: failed to allocate replay");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*array)[(*num)++] = value;
+}
+
+
+/*
+ * Makes a record wait for an earlier one.
+ */
+static void depend(int earlier, int later) {
+    replay_item *item = &items[earlier];
+
+    if (earlier == later || earlier < 0)
+        return;
+    /* the same edge is often added twice in a row */
+    if (item->num_next > 0 && item->next[item->num_next - 1] == later)
+        return;
+    int_push(&item->next, &item->num_next, &item->next_size, later);
+    items[later].deps++;
+}
+
+
+/*
+ * Finds a key, adding it if it is new.
+ */
+static replay_key *key_get(const char *path, int len, int kind) {
+    unsigned int hash = name_hash(path, len) * 2 + kind;
+
+    if (2 * (num_keys + 1) > keys_size) {
+        replay_key *old = keys;
+        int old_size = keys_size;
+
+        keys_size = keys_size > 0 ? 2 * keys_size : 1024;
+        if ((keys = calloc(keys_size, sizeof(replay_key))) == NULL) {
+            perror("Error: failed to allocate replay");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < old_size; i++) {
+            if (old[i].path == NULL)
+                continue;
+            int s = old[i].hash & (keys_size - 1);
+            while (keys[s].path != NULL)
+                s = (s + 1) & (keys_size - 1);
+            keys[s] = old[i];
+        }
+        free(old);
+    }
+
+    int s = hash & (keys_size - 1);
+    for (; keys[s].path != NULL; s = (s + 1) & (keys_size - 1)) {
+        if (keys[s].hash == hash && keys[s].len == len && keys[s].kind == kind &&
+            memcmp(keys[s].path, path, len) == 0)
+            return &keys[s];
+    }
+    keys[s].path = path;
+    keys[s].len = len;
+    keys[s].kind = kind;
+    keys[s].hash = hash;
+    keys[s].writer = -1;
+    num_keys++;
+    return &keys[s];
+}
+
+
+/*
+ * Notes that a record needs a key to stay put.
+ */
+static void key_read(int item, const char *path, int len, int kind) {
+    replay_key *key = key_get(path, len, kind);
+
+    depend(key->writer, item);
+    if (key->num_readers == 0 || key->readers[key->num_readers - 1] != item)
+        int_push(&key->readers, &key->num_readers, &key->readers_size, item);
+}
+
+
+/*
+ * Notes that a record changes a key.
+ */
+static void key_write(int item, const char *path, int len, int kind) {
+    replay_key *key = key_get(path, len, kind);
+
+    depend(key->writer, item);
+    for (int i = 0; i < key->num_readers; i++)
+        depend(key->readers[i], item);
+    key->writer = item;
+    key->num_readers = 0;
+}
+
+
+/*
+ * Normalizes a path in place: no leading, trailing or repeated slashes.
+ * Returns: its length
+ */
+static int normalize(char *path) {
+    int len = 0;
+
+    for (char *c = path; *c != '\0'; c++) {
+        if (*c == '/' && (len == 0 || path[len - 1] == '/'))
+            continue;
+        path[len++] = *c;
+    }
+    if (len > 0 && path[len - 1] == '/')
+        len--;
+    path[len] = '\0';
+    return len;
+}
+
+
+/*
+ * Adds the keys of one path of a record: it changes the node and the
+ * entries of its parent, and needs every directory above it to stay put
+ * (the root always does).
+ */
+static void add_path(int item, char *path) {
+    int len = normalize(path), parent = 0;
+
+    for (int i = 0; i < len; i++) {
+        if (path[i] == '/') {
+            key_read(item, path, i, KEY_NODE);
+            parent = i;
+        }
+    }
+    key_write(item, path, parent, KEY_ENTRIES);
+    key_write(item, path, len, KEY_NODE);
+}
+
+
+/*
+ * Marks a record as replayed and hands out the records waiting for it.
+ * Called with ready_lock held.
+ */
+static void record_done(int item) {
+    for (int i = 0; i < items[item].num_next; i++) {
+        int next = items[item].next[i];
+        if (--items[next].deps == 0)
+            ready[num_ready++] = next;
+    }
+    if (++num_done == num_items || num_ready > 0)
+        pthread_cond_broadcast(&ready_cond);
+}
+
+
+/*
+ * Replay thread: replays ready records until every record is replayed.
+ */
+static void *replayer(void *arg) {
+    pthread_mutex_lock(&ready_lock);
+    while (1) {
+        while (num_ready == 0 && num_done < num_items)
+            pthread_cond_wait(&ready_cond, &ready_lock);
+        if (num_done == num_items)
+            break;
+        int item = ready[--num_ready];
+        pthread_mutex_unlock(&ready_lock);
+
+        apply_record(&items[item].rec, items[item].path, items[item].new_path);
+
+        pthread_mutex_lock(&ready_lock);
+        record_done(item);
+    }
+    pthread_mutex_unlock(&ready_lock);
+    return NULL;
+}
+
+
+/*
+ * Replays records of the log, on several threads when there are many.
+ * The paths of the records may be changed.
+ * Input:
+ *  - records: the records, in log order
+ *  - num: number of records
+ *  - apply: replays a record; called by many threads at once
+ */
+void replay_records(replay_item *records, int num, wal_apply apply) {
+    pthread_t threads[REPLAY_MAX_THREADS];
+    int cpus = cpus_available();
+    int num_threads = cpus < REPLAY_MAX_THREADS ? cpus : REPLAY_MAX_THREADS;
+
+    if (num < REPLAY_MIN_PARALLEL || num_threads < 2) {
+        for (int i = 0; i < num; i++)
+            apply(&records[i].rec, records[i].path, records[i].new_path);
+        return;
+    }
+
+    items = records;
+    num_items = num;
+    apply_record = apply;
+    for (int i = 0; i < num; i++) {
+        add_path(i, items[i].path);
+        if (items[i].new_path != NULL)
+            add_path(i, items[i].new_path);
+    }
+    for (int i = 0; i < keys_size; i++)
+        free(keys[i].readers);
+    free(keys);
+    keys = NULL;
+    keys_size = num_keys = 0;
+
+    if ((ready = malloc(sizeof(int) * num)) == NULL) {
+        perror("Error: failed to allocate replay");
+        exit(EXIT_FAILURE);
+    }
+    num_ready = num_done = 0;
+    for (int i = num - 1; i >= 0; i--) {
+        if (items[i].deps == 0)
+            ready[num_ready++] = i;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, replayer, NULL) != 0) {
+            perror("Error: failed to create replay thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            perror("Error: failed to join replay thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < num; i++)
+        free(items[i].next);
+    free(ready);
+}
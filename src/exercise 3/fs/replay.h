@@ -0,0 +1,33 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "wal.h"
+
+/*
+ * Parallel replay of the log. Records are ordered only where they touch
+ * the same nodes: a record changes its node and the entries of its
+ * parent directory, and needs every directory above its node to stay
+ * put. Records that touch the same directory are replayed in log order,
+ * and one that creates, deletes or moves a directory is ordered with the
+ * records below it; the others are replayed at once by several threads.
+ */
+
+/* Most threads replaying records, and fewest records worth them */
+#define REPLAY_MAX_THREADS 8
+#define REPLAY_MIN_PARALLEL 1024
+
+/* A record of the log to replay */
+typedef struct replay_item {
+    wal_record rec;
+    char *path;
+    char *new_path;
+    int deps;      /* earlier records it waits for, not replayed yet */
+    int num_next;  /* later records waiting for it */
+    int next_size;
+    int *next;
+} replay_item;
+
+/* Prototype functions of replay.c */
+void replay_records(replay_item *items, int num, wal_apply apply);
+
+#endif /* REPLAY_H */
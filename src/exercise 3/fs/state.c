@@ -1,13 +1,99 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
 #include "state.h"
+#include "epoch.h"
 #include <pthread.h>
 #include "../tecnicofs-api-constants.h"
 
-/* Inode table */
-inode_t inode_table[INODE_TABLE_SIZE];
+/* Inode table: chunks of INODE_CHUNK_SIZE i-nodes, allocated on demand */
+static inode_t *inode_chunks[INODE_MAX_CHUNKS];
+
+/* Number of i-nodes currently backed by allocated chunks */
+static int inode_table_size = 0;
+
+/* Serializes the growth of the inode table */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Head of the lock-free stack of freed inumbers. The low 32 bits hold the
+ * inumber on top (FREE_INODE when empty) and the high 32 bits a tag that
+ * changes on every push and pop, so a stale head never passes the CAS (ABA).
+ */
+static uint64_t free_head = (uint32_t) FREE_INODE;
+
+/* First inumber that was never handed out */
+static int next_unused = 0;
+
+/*
+ * Copy-on-write snapshot of the namespace, used by print. While a
+ * snapshot is active, the first change to an i-node saves its type and
+ * entries, so the snapshot can still be read after the i-node changes.
+ */
+static unsigned int snapshot_gen = 0;
+static int snapshot_active = 0;
+/* List (through snap_next) of the i-nodes saved for the active snapshot */
+static int snapshot_saved = FREE_INODE;
+
+/*
+ * I-nodes changed since the last checkpoint, for the next one to write.
+ * Each checkpoint starts a new generation; the i-nodes changed during a
+ * generation are linked through dirty_next[gen & 1], so the list of the
+ * previous generation can still be read while the next one grows.
+ */
+static unsigned int dirty_gen = 1;
+static int dirty_heads[2] = { FREE_INODE, FREE_INODE };
+
+
+/*
+ * Returns the address of the i-node with the given inumber.
+ * The inumber must be below inode_table_size.
+ */
+static inline inode_t *inode_at(int inumber) {
+    inode_t *chunk = __atomic_load_n(&inode_chunks[inumber >> INODE_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    return &chunk[inumber & (INODE_CHUNK_SIZE - 1)];
+}
+
+/*
+ * Checks if an inumber refers to a slot of the table.
+ */
+static inline int inode_in_table(int inumber) {
+    return inumber >= 0 && inumber < __atomic_load_n(&inode_table_size, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Checks if an inumber refers to an i-node in use.
+ */
+static inline int inode_valid(int inumber) {
+    return inode_in_table(inumber) && inode_at(inumber)->nodeType != T_NONE;
+}
+
+/*
+ * Marks the start of a change to an i-node's type or entries.
+ * Writers are serialized by the i-node's lock.
+ */
+static inline void inode_write_begin(inode_t *inode) {
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*
+ * Marks the end of a change started with inode_write_begin.
+ */
+static inline void inode_write_end(inode_t *inode) {
+    __atomic_store_n(&inode->seq, inode->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Checks if an i-node changed since its sequence number was read.
+ */
+static inline int inode_read_retry(inode_t *inode, unsigned int seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&inode->seq, __ATOMIC_RELAXED) != seq;
+}
 
 /*
  * Sleeps for synchronization testing.
@@ -18,43 +104,760 @@ void insert_delay(int cycles) {
 
 
 /*
- * Initializes the i-nodes table.
+ * Returns the number of cpus the server may run on, which taskset may
+ * make fewer than the cpus online.
+ */
+int cpus_available() {
+    cpu_set_t set;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        return CPU_COUNT(&set);
+    return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+
+/*
+ * Hashes a name of len bytes (FNV-1a).
+ */
+unsigned int name_hash(const char *name, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Maximum number of entries of a directory table with num_slots slots.
+ */
+static inline int dir_max_entries(int num_slots) {
+    return num_slots - num_slots / 4;
+}
+
+/*
+ * Bytes of the name pool taken by a name of len bytes.
+ */
+static inline int dir_name_room(int len) {
+    return len < DIR_INLINE_NAME ? 0 : len;
+}
+
+/*
+ * Returns the name of an entry (len bytes, not NUL terminated).
+ */
+static inline const char *dir_entry_name(DirTable *dir, DirEntry *entry) {
+    return entry->len < DIR_INLINE_NAME ? entry->name.str : dir->names + entry->name.offset;
+}
+
+/*
+ * Stores a name in an entry, in place or at the end of the name pool,
+ * which must have room for it.
+ */
+static void dir_entry_set_name(DirTable *dir, DirEntry *entry, const char *name, int len) {
+    entry->len = len;
+    if (len < DIR_INLINE_NAME) {
+        memcpy(entry->name.str, name, len);
+    }
+    else {
+        memcpy(dir->names + dir->names_used, name, len);
+        entry->name.offset = dir->names_used;
+        dir->names_used += len;
+    }
+}
+
+/*
+ * Checks if an entry has the given name. Optimistic readers may see an
+ * entry while it changes, so a pool offset is bounds checked before use.
+ */
+static int dir_entry_is(DirTable *dir, DirEntry *entry, const char *name, int len) {
+    if (entry->len != len)
+        return 0;
+    if (len < DIR_INLINE_NAME)
+        return memcmp(entry->name.str, name, len) == 0;
+    return len <= dir->names_size && entry->name.offset <= (unsigned int) (dir->names_size - len) &&
+           memcmp(dir->names + entry->name.offset, name, len) == 0;
+}
+
+/*
+ * Allocates an empty directory table.
+ * Input:
+ *  - num_slots: number of hash slots, a power of 2
+ *  - names_size: size of the name pool
+ */
+static DirTable *dir_table_alloc(int num_slots, int names_size) {
+    DirTable *dir = malloc(sizeof(DirTable) + sizeof(int) * num_slots +
+                           sizeof(DirEntry) * dir_max_entries(num_slots) + names_size);
+    if (dir == NULL) {
+        perror("Error: failed to allocate directory");
+        exit(EXIT_FAILURE);
+    }
+    dir->num_entries = 0;
+    dir->num_deleted = 0;
+    dir->num_slots = num_slots;
+    dir->names_used = 0;
+    dir->names_size = names_size;
+    dir->slots = (int *) (dir + 1);
+    dir->entries = (DirEntry *) (dir->slots + num_slots);
+    dir->names = (char *) (dir->entries + dir_max_entries(num_slots));
+    for (int i = 0; i < num_slots; i++)
+        dir->slots[i] = FREE_INODE;
+    return dir;
+}
+
+/*
+ * Finds the slot that indexes an entry.
+ * Input:
+ *  - dir: directory table
+ *  - name, len: name of the entry
+ *  - hash: hash of name
+ * Returns:
+ *  slot: index in dir->slots holding the entry's position
+ *  FAIL: if there is no entry with that name
+ */
+static int dir_find_slot(DirTable *dir, const char *name, int len, unsigned int hash) {
+    int mask = dir->num_slots - 1;
+
+    /* bounded so optimistic readers cannot loop on a table being changed */
+    for (int n = 0, s = hash & mask; n < dir->num_slots; n++, s = (s + 1) & mask) {
+        int pos = dir->slots[s];
+        if (pos == FREE_INODE)
+            return FAIL;
+        if (pos != DELETED_ENTRY && dir->entries[pos].hash == hash &&
+            dir_entry_is(dir, &dir->entries[pos], name, len))
+            return s;
+    }
+    return FAIL;
+}
+
+/*
+ * Finds the slot that indexes the entry at position pos.
+ */
+static int dir_find_pos_slot(DirTable *dir, int pos) {
+    int mask = dir->num_slots - 1;
+    int s = dir->entries[pos].hash & mask;
+
+    while (dir->slots[s] != pos)
+        s = (s + 1) & mask;
+    return s;
+}
+
+/*
+ * Indexes the entry at position pos in the first free slot of its chain.
+ */
+static void dir_insert_slot(DirTable *dir, int pos) {
+    int mask = dir->num_slots - 1;
+    int s = dir->entries[pos].hash & mask;
+
+    while (dir->slots[s] >= 0)
+        s = (s + 1) & mask;
+    if (dir->slots[s] == DELETED_ENTRY)
+        dir->num_deleted--;
+    dir->slots[s] = pos;
+}
+
+/*
+ * Copies a directory table into a new one with num_slots slots, dropping
+ * deleted slots and the names of removed entries. The old table is
+ * retired, as optimistic readers may still be probing it.
+ * Input:
+ *  - old: the table
+ *  - num_slots: number of hash slots of the new table
+ *  - room: free space needed in the new name pool
+ */
+static DirTable *dir_table_rebuild(DirTable *old, int num_slots, int room) {
+    int live = 0;
+
+    for (int pos = 0; pos < old->num_entries; pos++)
+        live += dir_name_room(old->entries[pos].len);
+    /* twice what is needed, so the pool grows geometrically */
+    DirTable *dir = dir_table_alloc(num_slots, 2 * (live + room));
+
+    for (int pos = 0; pos < old->num_entries; pos++) {
+        DirEntry *entry = &dir->entries[pos];
+        *entry = old->entries[pos];
+        dir_entry_set_name(dir, entry, dir_entry_name(old, &old->entries[pos]), entry->len);
+    }
+    dir->num_entries = old->num_entries;
+    for (int pos = 0; pos < dir->num_entries; pos++)
+        dir_insert_slot(dir, pos);
+    epoch_retire(old);
+    return dir;
+}
+
+/*
+ * Returns a copy of a directory table.
+ */
+static DirTable *dir_table_clone(DirTable *old) {
+    DirTable *dir = dir_table_alloc(old->num_slots, old->names_size);
+
+    memcpy(dir->slots, old->slots, sizeof(int) * old->num_slots);
+    memcpy(dir->entries, old->entries, sizeof(DirEntry) * old->num_entries);
+    memcpy(dir->names, old->names, old->names_used);
+    dir->num_entries = old->num_entries;
+    dir->num_deleted = old->num_deleted;
+    dir->names_used = old->names_used;
+    return dir;
+}
+
+/*
+ * Writes zeros to a file.
+ * Returns: SUCCESS or FAIL
+ */
+static int write_zeros(FILE *fp, size_t len) {
+    static const char zeros[4096];
+
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if (fwrite(zeros, 1, n, fp) != n)
+            return FAIL;
+        len -= n;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Writes the image of a directory table: a DirImage and then its slots,
+ * entries and name pool laid out as in memory, with their free space
+ * zeroed, so the table can be used in place by dir_table_map.
+ * Input:
+ *  - fp: file to output
+ *  - dir: the table
+ * Returns: number of bytes written, or FAIL
+ */
+long dir_table_write(FILE *fp, DirTable *dir) {
+    int max_entries = dir_max_entries(dir->num_slots);
+    DirImage image = { dir->num_entries, dir->num_deleted, dir->num_slots,
+                       dir->names_used, dir->names_size, 0 };
+
+    if (fwrite(&image, sizeof(image), 1, fp) != 1 ||
+        fwrite(dir->slots, sizeof(int), dir->num_slots, fp) != dir->num_slots ||
+        fwrite(dir->entries, sizeof(DirEntry), dir->num_entries, fp) != dir->num_entries ||
+        write_zeros(fp, sizeof(DirEntry) * (max_entries - dir->num_entries)) == FAIL ||
+        fwrite(dir->names, 1, dir->names_used, fp) != dir->names_used ||
+        write_zeros(fp, dir->names_size - dir->names_used) == FAIL)
+        return FAIL;
+    return sizeof(image) + sizeof(int) * dir->num_slots +
+           sizeof(DirEntry) * max_entries + dir->names_size;
+}
+
+/*
+ * Checks an image written by dir_table_write.
+ * Input:
+ *  - image: the image
+ *  - room: bytes available from image on
+ * Returns: size of the image, or FAIL if it is not valid
+ */
+long dir_image_size(char *image, size_t room) {
+    DirImage header;
+    size_t size;
+
+    if (room < sizeof(header))
+        return FAIL;
+    memcpy(&header, image, sizeof(header));
+    if (header.num_slots < DIR_INITIAL_SLOTS || (header.num_slots & (header.num_slots - 1)) ||
+        header.num_entries < 0 || header.num_entries > dir_max_entries(header.num_slots) ||
+        header.num_deleted < 0 || header.names_used < 0 || header.names_size < header.names_used)
+        return FAIL;
+    size = sizeof(header) + sizeof(int) * header.num_slots +
+           sizeof(DirEntry) * dir_max_entries(header.num_slots) + header.names_size;
+    return size <= room ? size : FAIL;
+}
+
+
+/*
+ * Makes a directory table out of an image written by dir_table_write.
+ * Only the table itself is allocated: its arrays stay in the image, which
+ * must be writable and outlive the table (freeing the table is enough).
+ * Input:
+ *  - image: the image
+ *  - room: bytes available from image on
+ * Returns: the table, or NULL if the image is not valid
+ */
+DirTable *dir_table_map(char *image, size_t room) {
+    DirImage header;
+
+    if (dir_image_size(image, room) == FAIL)
+        return NULL;
+    memcpy(&header, image, sizeof(header));
+
+    DirTable *dir = malloc(sizeof(DirTable));
+    if (dir == NULL) {
+        perror("Error: failed to allocate directory");
+        exit(EXIT_FAILURE);
+    }
+    dir->num_entries = header.num_entries;
+    dir->num_deleted = header.num_deleted;
+    dir->num_slots = header.num_slots;
+    dir->names_used = header.names_used;
+    dir->names_size = header.names_size;
+    dir->slots = (int *) (image + sizeof(header));
+    dir->entries = (DirEntry *) (dir->slots + dir->num_slots);
+    dir->names = (char *) (dir->entries + dir_max_entries(dir->num_slots));
+    return dir;
+}
+
+/*
+ * Looks for an entry of a directory by name.
+ * Input:
+ *  - dir: directory table
+ *  - name, len: name of the entry
+ * Returns:
+ *  inumber: the entry's inumber
+ *     FAIL: if not found
+ */
+int dir_lookup_entry(DirTable *dir, const char *name, int len) {
+    if (dir == NULL)
+        return FAIL;
+
+    int s = dir_find_slot(dir, name, len, name_hash(name, len));
+    if (s == FAIL)
+        return FAIL;
+    return dir->entries[dir->slots[s]].inumber;
+}
+
+
+/*
+ * Saves the state of an i-node for the active snapshot, if that was not
+ * done yet. Called with the i-node write locked, before changing it.
+ */
+static void inode_snapshot_save(int inumber, inode_t *inode) {
+    if (!snapshot_active || inode->snap_gen == snapshot_gen)
+        return;
+
+    inode->snap_type = inode->nodeType;
+    inode->snap_dir = inode->nodeType == T_DIRECTORY ? dir_table_clone(inode->data.dir) : NULL;
+    inode->snap_gen = snapshot_gen;
+
+    inode->snap_next = __atomic_load_n(&snapshot_saved, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&snapshot_saved, &inode->snap_next, inumber, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Adds an i-node about to change to the i-nodes changed since the last
+ * checkpoint, unless it is there already. Called by the only thread
+ * changing the i-node.
+ */
+static void inode_mark_dirty(int inumber, inode_t *inode) {
+    if (inode->dirty_gen == dirty_gen)
+        return;
+
+    int *head = &dirty_heads[dirty_gen & 1];
+    int *next = &inode->dirty_next[dirty_gen & 1];
+    inode->dirty_gen = dirty_gen;
+    *next = __atomic_load_n(head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(head, next, inumber, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Adds a new chunk of i-nodes to the table.
+ * Input:
+ *  - old_size: table size seen by the caller; nothing is done if another
+ *              thread already grew the table past it
+ * Returns: SUCCESS or FAIL (table is at its maximum size)
+ */
+static int inode_table_grow(int old_size) {
+    int res = SUCCESS;
+
+    if ( pthread_mutex_lock(&table_lock) != SUCCESS ) {
+        perror("Error: failed to lock");
+        exit(EXIT_FAILURE);
+    }
+
+    if (inode_table_size == old_size) {
+        int c = inode_table_size >> INODE_CHUNK_BITS;
+
+        if (c == INODE_MAX_CHUNKS) {
+            res = FAIL;
+        }
+        else {
+            inode_t *chunk = malloc(sizeof(inode_t) * INODE_CHUNK_SIZE);
+            if (chunk == NULL) {
+                perror("Error: failed to grow the inode table");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < INODE_CHUNK_SIZE; i++) {
+                chunk[i].nodeType = T_NONE;
+                chunk[i].data.dir = NULL;
+                chunk[i].next_free = FREE_INODE;
+                chunk[i].seq = 0;
+                chunk[i].open_count = 0;
+                chunk[i].snap_gen = 0;
+                chunk[i].snap_dir = NULL;
+                chunk[i].dirty_gen = 0;
+                chunk[i].name_gen = 0;
+                chunk[i].child_gen = 0;
+                pthread_rwlock_init(&chunk[i].lock, NULL);
+            }
+            /* publish the chunk before the slots become visible */
+            __atomic_store_n(&inode_chunks[c], chunk, __ATOMIC_RELEASE);
+            __atomic_store_n(&inode_table_size, inode_table_size + INODE_CHUNK_SIZE, __ATOMIC_RELEASE);
+        }
+    }
+
+    if ( pthread_mutex_unlock(&table_lock) != SUCCESS ) {
+        perror("Error: failed to unlock");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+
+/*
+ * Builds a new head for the free stack on top of the given one.
+ */
+static inline uint64_t free_head_make(uint64_t old_head, int inumber) {
+    return (((old_head >> 32) + 1) << 32) | (uint32_t) inumber;
+}
+
+
+/*
+ * Returns an inumber to the free stack.
+ */
+static void inode_free(int inumber) {
+    inode_t *inode = inode_at(inumber);
+    uint64_t head = __atomic_load_n(&free_head, __ATOMIC_RELAXED);
+
+    do {
+        __atomic_store_n(&inode->next_free, (int) (uint32_t) head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&free_head, &head, free_head_make(head, inumber),
+                                          1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Takes an unused inumber, from the free stack or from the never used
+ * slots, growing the table when those run out.
+ * Returns:
+ *  inumber: the reserved inumber
+ *     FAIL: if the table is full
+ */
+static int inode_alloc() {
+    uint64_t head = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+
+    while ((int) (uint32_t) head != FREE_INODE) {
+        int inumber = (int) (uint32_t) head;
+        int next = __atomic_load_n(&inode_at(inumber)->next_free, __ATOMIC_RELAXED);
+
+        if (__atomic_compare_exchange_n(&free_head, &head, free_head_make(head, next),
+                                        1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return inumber;
+    }
+
+    /* free stack is empty; next_unused never goes past the table size,
+     * so a full table does not keep counting up */
+    int inumber = __atomic_load_n(&next_unused, __ATOMIC_RELAXED);
+    do {
+        if (inumber >= INODE_TABLE_SIZE)
+            return FAIL;
+    } while (!__atomic_compare_exchange_n(&next_unused, &inumber, inumber + 1,
+                                          1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    while (!inode_in_table(inumber)) {
+        if (inode_table_grow(__atomic_load_n(&inode_table_size, __ATOMIC_ACQUIRE)) == FAIL) {
+            /* give the inumber back instead of losing it, if its slot is
+             * in the table */
+            if (inode_in_table(inumber))
+                inode_free(inumber);
+            return FAIL;
+        }
+    }
+    return inumber;
+}
+
+
+/*
+ * Initializes the i-nodes table.
+ */
+void inode_table_init() {
+    if (inode_table_grow(0) == FAIL) {
+        fprintf(stderr, "Error: could not allocate the inode table\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Returns the number of i-nodes the table has room for.
+ */
+int inode_table_capacity() {
+    return __atomic_load_n(&inode_table_size, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Puts back an i-node read from a checkpoint, before the fs is used,
+ * replacing what an older checkpoint restored.
+ * Input:
+ *  - inumber: identifier the i-node had
+ *  - nType: the type of the node, T_NONE if it was free
+ *  - dir: entries of a directory, NULL otherwise
+ */
+void inode_restore(int inumber, type nType, DirTable *dir) {
+    while (!inode_in_table(inumber)) {
+        if (inumber >= INODE_TABLE_SIZE || inode_table_grow(inode_table_size) == FAIL) {
+            fprintf(stderr, "Error: could not restore inumber %d\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    inode_t *inode = inode_at(inumber);
+    if (inode->nodeType == T_DIRECTORY)
+        free(inode->data.dir);
+    inode->nodeType = nType;
+    inode->data.dir = dir;
+}
+
+
+/*
+ * Ends the restore of the i-nodes: the inumbers below num_inodes that
+ * were not restored are freed, and the others are handed out after them.
+ * Input:
+ *  - num_inodes: one past the highest inumber restored
+ */
+void inode_table_restored(int num_inodes) {
+    next_unused = num_inodes;
+    for (int inumber = num_inodes - 1; inumber >= 0; inumber--) {
+        if (inode_at(inumber)->nodeType == T_NONE)
+            inode_free(inumber);
+    }
+}
+
+
+/*
+ * Locks a specific inode in a given inumber for writing or reading
+*/
+void inode_lock(int inumber, char c)
+{
+    if (!inode_in_table(inumber)) {
+        fprintf(stderr, "Error: could not lock invalid inumber: %d.\n", inumber);
+        exit(EXIT_FAILURE);
+    }
+    if (c == 'r') {
+        if ( pthread_rwlock_rdlock(&inode_at(inumber)->lock) != SUCCESS ) {
+            fprintf(stderr, "Error: could not rdlock at inumber: %d.\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (c == 'w') {
+        if ( pthread_rwlock_wrlock(&inode_at(inumber)->lock) != SUCCESS ) {
+            fprintf(stderr, "Error: could not wrlock at inumber: %d.\n", inumber);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Unlocks a specific node of the inode table in a given inumber
+*/ 
+void inode_unlock(int inumber)
+{
+    if (!inode_in_table(inumber)) {
+        fprintf(stderr, "Error: could not unlock invalid inumber: %d.\n", inumber);
+        exit(EXIT_FAILURE);
+    }
+    pthread_rwlock_unlock(&inode_at(inumber)->lock);
+}
+
+
+/*
+ * Frees the contents of a file.
+ */
+static void file_data_free(FileData *file) {
+    if (file == NULL)
+        return;
+    for (int b = 0; b < file->num_blocks; b++)
+        free(file->blocks[b]);
+    free(file->blocks);
+    free(file);
+}
+
+
+/*
+ * Makes room for num_blocks blocks; the new ones are holes.
+ * Returns: SUCCESS or FAIL
+ */
+static int file_data_reserve(FileData *file, int num_blocks) {
+    if (num_blocks > file->capacity) {
+        int capacity = file->capacity ? file->capacity : 4;
+        while (capacity < num_blocks)
+            capacity *= 2;
+        char **blocks = realloc(file->blocks, sizeof(char *) * capacity);
+        if (blocks == NULL)
+            return FAIL;
+        file->blocks = blocks;
+        file->capacity = capacity;
+    }
+    for (int b = file->num_blocks; b < num_blocks; b++)
+        file->blocks[b] = NULL;
+    if (num_blocks > file->num_blocks)
+        file->num_blocks = num_blocks;
+    return SUCCESS;
+}
+
+
+/*
+ * Returns the contents of a file i-node, creating them if needed, or
+ * NULL if the i-node is not a file.
+ */
+static FileData *file_data_get(int inumber, int create) {
+    if (!inode_valid(inumber))
+        return NULL;
+
+    inode_t *inode = inode_at(inumber);
+    if (inode->nodeType != T_FILE)
+        return NULL;
+    if (inode->data.file == NULL && create) {
+        inode->data.file = calloc(1, sizeof(FileData));
+        if (inode->data.file == NULL) {
+            perror("Error: failed to allocate file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return inode->data.file;
+}
+
+
+/*
+ * Reads from a file. The i-node must be locked.
+ * Input:
+ *  - inumber: identifier of the file i-node
+ *  - buf: where to store the bytes read
+ *  - len: number of bytes to read
+ *  - offset: position of the first byte
+ * Returns: number of bytes read (0 past the end), or FAIL if not a file
+ */
+int inode_file_read(int inumber, char *buf, size_t len, size_t offset) {
+    if (!inode_valid(inumber) || inode_at(inumber)->nodeType != T_FILE)
+        return FAIL;
+
+    FileData *file = file_data_get(inumber, 0);
+    if (file == NULL || offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+    if (len > INT32_MAX)
+        len = INT32_MAX;
+
+    for (size_t done = 0; done < len; ) {
+        size_t pos = offset + done;
+        char *block = file->blocks[pos >> FILE_BLOCK_BITS];
+        size_t in_block = pos & (FILE_BLOCK_SIZE - 1);
+        size_t n = FILE_BLOCK_SIZE - in_block;
+        if (n > len - done)
+            n = len - done;
+        if (block == NULL)
+            memset(buf + done, 0, n);
+        else
+            memcpy(buf + done, block + in_block, n);
+        done += n;
+    }
+    return len;
+}
+
+
+/*
+ * Writes to a file, growing it if needed. The i-node must be write locked.
+ * Input:
+ *  - inumber: identifier of the file i-node
+ *  - buf: bytes to write
+ *  - len: number of bytes to write
+ *  - offset: position of the first byte; past the end leaves a hole
+ * Returns: number of bytes written, or FAIL
+ */
+int inode_file_write(int inumber, char *buf, size_t len, size_t offset) {
+    FileData *file = file_data_get(inumber, 1);
+    if (file == NULL || len > INT32_MAX || offset + len < offset)
+        return FAIL;
+    if (len == 0)
+        return 0;
+
+    size_t end = offset + len;
+    if ((end - 1) >> FILE_BLOCK_BITS >= INT32_MAX ||
+        file_data_reserve(file, ((end - 1) >> FILE_BLOCK_BITS) + 1) == FAIL)
+        return FAIL;
+
+    for (size_t done = 0; done < len; ) {
+        size_t pos = offset + done;
+        char **block = &file->blocks[pos >> FILE_BLOCK_BITS];
+        size_t in_block = pos & (FILE_BLOCK_SIZE - 1);
+        size_t n = FILE_BLOCK_SIZE - in_block;
+        if (n > len - done)
+            n = len - done;
+        if (*block == NULL && (*block = calloc(1, FILE_BLOCK_SIZE)) == NULL)
+            return FAIL;
+        memcpy(*block + in_block, buf + done, n);
+        done += n;
+    }
+    if (end > file->size)
+        file->size = end;
+    return len;
+}
+
+
+/*
+ * Sets the size of a file: blocks past the new end are freed, and a
+ * larger size leaves a hole. The i-node must be write locked.
+ * Returns: SUCCESS or FAIL
  */
-void inode_table_init() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        inode_table[i].nodeType = T_NONE;
-        inode_table[i].data.dirEntries = NULL;
-        inode_table[i].data.fileContents = NULL;
-        pthread_rwlock_init(&inode_table[i].lock ,NULL);
+int inode_file_truncate(int inumber, size_t size) {
+    FileData *file = file_data_get(inumber, 1);
+    if (file == NULL)
+        return FAIL;
+
+    int num_blocks = (size + FILE_BLOCK_SIZE - 1) >> FILE_BLOCK_BITS;
+    if ((size + FILE_BLOCK_SIZE - 1) >> FILE_BLOCK_BITS > INT32_MAX)
+        return FAIL;
+
+    if (size < file->size) {
+        for (int b = num_blocks; b < file->num_blocks; b++) {
+            free(file->blocks[b]);
+            file->blocks[b] = NULL;
+        }
+        file->num_blocks = num_blocks;
+        /* keep the bytes past the end of the file zero */
+        size_t in_block = size & (FILE_BLOCK_SIZE - 1);
+        if (in_block != 0 && file->blocks[num_blocks - 1] != NULL)
+            memset(file->blocks[num_blocks - 1] + in_block, 0, FILE_BLOCK_SIZE - in_block);
     }
+    else if (file_data_reserve(file, num_blocks) == FAIL)
+        return FAIL;
+
+    file->size = size;
+    return SUCCESS;
 }
 
 
 /*
- * Locks a specific inode in a given inumber for writing or reading
-*/
-void inode_lock(int inumber, char c)
-{
-    if (c == 'r') {
-        if ( pthread_rwlock_rdlock(&inode_table[inumber].lock) != SUCCESS ) {
-            fprintf(stderr, "Error: could not rdlock at inumber: %d.\n", inumber);
-            exit(EXIT_FAILURE);
-        }
-    }
-    else if (c == 'w') {
-        if ( pthread_rwlock_wrlock(&inode_table[inumber].lock) != SUCCESS ) {
-            fprintf(stderr, "Error: could not wrlock at inumber: %d.\n", inumber);
-            exit(EXIT_FAILURE);
-        }
-    }
+ * Gets the size of a file. The i-node must be locked.
+ * Returns: SUCCESS or FAIL if not a file
+ */
+int inode_file_size(int inumber, size_t *size) {
+    if (!inode_valid(inumber) || inode_at(inumber)->nodeType != T_FILE)
+        return FAIL;
+
+    FileData *file = inode_at(inumber)->data.file;
+    *size = file ? file->size : 0;
+    return SUCCESS;
 }
 
+
 /*
- * Unlocks a specific node of the inode table in a given inumber
-*/ 
-void inode_unlock(int inumber)
-{
-    pthread_rwlock_unlock(&inode_table[inumber].lock);
+ * Replaces the contents of a file. The i-node must be write locked.
+ * Input:
+ *  - inumber: identifier of the file i-node
+ *  - fileContents: new contents
+ *  - len: size of the new contents
+ * Returns: SUCCESS or FAIL
+ */
+int inode_set_file(int inumber, char *fileContents, int len) {
+    if (len < 0 || inode_file_truncate(inumber, 0) == FAIL ||
+        inode_file_write(inumber, fileContents, len, 0) == FAIL)
+        return FAIL;
+    return SUCCESS;
 }
 
 
@@ -62,17 +865,25 @@ void inode_unlock(int inumber)
  * Releases the allocated memory for the i-nodes tables.
 */
 void inode_table_destroy() {
-    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
-        if (inode_table[i].nodeType != T_NONE) {
-            /* as data is an union, the same pointer is used for both dirEntries and fileContents */
-            /* just release one of them */
-	    if (inode_table[i].data.dirEntries)
-            free(inode_table[i].data.dirEntries);
-        
-        // releases hte bytes associated with the inode in the indicated index of the inode table in the memory
-        pthread_rwlock_destroy(&inode_table[i].lock);
+    for (int c = 0; c < (inode_table_size >> INODE_CHUNK_BITS); c++) {
+        inode_t *chunk = inode_chunks[c];
+
+        for (int i = 0; i < INODE_CHUNK_SIZE; i++) {
+            if (chunk[i].nodeType == T_FILE)
+                file_data_free(chunk[i].data.file);
+            else if (chunk[i].nodeType != T_NONE && chunk[i].data.dir)
+                free(chunk[i].data.dir);
+            if (chunk[i].snap_dir)
+                free(chunk[i].snap_dir);
+            pthread_rwlock_destroy(&chunk[i].lock);
         }
+        free(chunk);
+        inode_chunks[c] = NULL;
     }
+    epoch_destroy();
+    inode_table_size = 0;
+    free_head = (uint32_t) FREE_INODE;
+    next_unused = 0;
 }
 
 /*
@@ -88,29 +899,29 @@ int inode_create(type nType, char c) {
     /* Used for testing synchronization speedup */
     //insert_delay(DELAY);
 
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if (inode_table[inumber].nodeType == T_NONE) {
-            
-            if ( c == 'w' )
-                inode_lock(inumber, 'w');
-
-            inode_table[inumber].nodeType = nType;
-
-            if (nType == T_DIRECTORY) {
-                /* Initializes entry table */
-                inode_table[inumber].data.dirEntries = malloc(sizeof(DirEntry) * MAX_DIR_ENTRIES);
-                
-                for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-                }
-            }
-            else {
-                inode_table[inumber].data.fileContents = NULL;
-            }
-            return inumber;
-        }
+    /* the allocator hands each free slot to a single caller */
+    int inumber = inode_alloc();
+    if (inumber == FAIL)
+        return FAIL;
+
+    inode_t *inode = inode_at(inumber);
+    if ( c == 'w' )
+        inode_lock(inumber, 'w');
+
+    /* the snapshot may still see the i-node as free */
+    inode_snapshot_save(inumber, inode);
+    inode_mark_dirty(inumber, inode);
+    inode_write_begin(inode);
+    if (nType == T_DIRECTORY) {
+        /* Initializes entry table */
+        inode->data.dir = dir_table_alloc(DIR_INITIAL_SLOTS, 0);
     }
-    return FAIL;
+    else {
+        inode->data.file = NULL;
+    }
+    inode->nodeType = nType;
+    inode_write_end(inode);
+    return inumber;
 }
 
 /*
@@ -123,15 +934,27 @@ int inode_delete(int inumber) {
     /* Used for testing synchronization speedup */
     //insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         printf("inode_delete: invalid inumber\n");
         return FAIL;
     } 
 
-    inode_table[inumber].nodeType = T_NONE;
-    /* see inode_table_destroy function */
-    if (inode_table[inumber].data.dirEntries)
-        free(inode_table[inumber].data.dirEntries);
+    inode_t *inode = inode_at(inumber);
+    type nType = inode->nodeType;
+    inode_snapshot_save(inumber, inode);
+    inode_mark_dirty(inumber, inode);
+    inode_write_begin(inode);
+    inode->nodeType = T_NONE;
+    /* file contents are only read under the i-node's lock */
+    if (nType == T_FILE)
+        file_data_free(inode->data.file);
+    else if (inode->data.dir)
+        epoch_retire(inode->data.dir);
+    inode->data.dir = NULL;
+    inode_write_end(inode);
+    /* before the inumber can be reused by another path */
+    inode_renamed(inumber);
+    inode_free(inumber);
     return SUCCESS;
 }
 
@@ -148,20 +971,130 @@ int inode_get(int inumber, type *nType, union Data *data) {
     /* Used for testing synchronization speedup */
     //insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         printf("inode_get: invalid inumber %d\n", inumber);
         return FAIL;
     }
 
+    inode_t *inode = inode_at(inumber);
     if (nType)
-        *nType = inode_table[inumber].nodeType;
+        *nType = inode->nodeType;
 
     if (data)
-        *data = inode_table[inumber].data;
+        *data = inode->data;
     return SUCCESS;
 }
 
 
+/*
+ * Takes a reference to an i-node for an open file descriptor. Must be
+ * called with the i-node locked, so that it is not being deleted.
+ */
+void inode_open(int inumber) {
+    __atomic_add_fetch(&inode_at(inumber)->open_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drops a reference taken by inode_open.
+ */
+void inode_close(int inumber) {
+    __atomic_sub_fetch(&inode_at(inumber)->open_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Checks if an i-node has open descriptors. Must be called with the
+ * i-node write locked, so no descriptor is being opened.
+ */
+int inode_is_open(int inumber) {
+    return __atomic_load_n(&inode_at(inumber)->open_count, __ATOMIC_RELAXED) > 0;
+}
+
+
+/*
+ * Returns the name generation of an i-node.
+ */
+unsigned int inode_name_gen(int inumber) {
+    return __atomic_load_n(&inode_at(inumber)->name_gen, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Marks that an i-node is no longer at the path it had, because it was
+ * deleted or moved: the cached paths through it become stale. Called
+ * once it is out of its parent, before it is unlocked.
+ */
+void inode_renamed(int inumber) {
+    __atomic_add_fetch(&inode_at(inumber)->name_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Returns the child generation of an i-node, which dir_add_entry bumps
+ * once the new entry can be found: a lookup that read it before looking
+ * in the directory and missed an entry sees it changed later.
+ */
+unsigned int inode_child_gen(int inumber) {
+    return __atomic_load_n(&inode_at(inumber)->child_gen, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Reads the sequence number of an i-node, to start an optimistic read.
+ */
+unsigned int inode_read_begin(int inumber) {
+    return __atomic_load_n(&inode_at(inumber)->seq, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Looks for an entry of a directory without taking its lock. The caller
+ * must be inside an epoch read section.
+ * Input:
+ *  - inumber: identifier of the directory i-node
+ *  - seq: sequence number of the directory, from inode_read_begin or a
+ *         previous call; replaced by the sequence number of the entry found
+ *  - name, len: name of the entry
+ *  - name_gen: set to the name generation of the entry found
+ * Returns:
+ *  inumber: the entry's inumber
+ *     FAIL: if the i-node is not a directory or has no such entry
+ *    RETRY: if the directory changed while it was read
+ */
+int inode_lookup_optimistic(int inumber, unsigned int *seq, const char *name, int len,
+                            unsigned int *name_gen) {
+    inode_t *inode = inode_at(inumber);
+    int sub_inumber = FAIL;
+    unsigned int sub_seq = 0;
+
+    if (*seq & 1)
+        return RETRY;
+
+    type nType = __atomic_load_n(&inode->nodeType, __ATOMIC_RELAXED);
+    DirTable *dir = __atomic_load_n(&inode->data.dir, __ATOMIC_ACQUIRE);
+
+    /* the type and data must belong together: a file's data is no DirTable */
+    if (inode_read_retry(inode, *seq))
+        return RETRY;
+
+    if (nType == T_DIRECTORY && dir != NULL) {
+        sub_inumber = dir_lookup_entry(dir, name, len);
+        if (sub_inumber != FAIL) {
+            if (!inode_in_table(sub_inumber))
+                return RETRY;
+            sub_seq = inode_read_begin(sub_inumber);
+            /* a delete or move bumps it after removing the entry, which
+             * the check below then sees */
+            *name_gen = inode_name_gen(sub_inumber);
+        }
+    }
+
+    /* the entry (and its sequence number) only counts if the directory did not change */
+    if (inode_read_retry(inode, *seq))
+        return RETRY;
+
+    *seq = sub_seq;
+    return sub_inumber;
+}
+
+
 /*
  *Unlocks all the nodes used in lookup commands
 */
@@ -175,36 +1108,48 @@ void unlock_all_nodes(int locks[],int size){
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name, len: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_reset_entry(int inumber, int sub_inumber) {
+int dir_reset_entry(int inumber, int sub_inumber, const char *sub_name, int len) {
     /* Used for testing synchronization speedup */
     //insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         printf("inode_reset_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    inode_t *inode = inode_at(inumber);
+    if (inode->nodeType != T_DIRECTORY) {
         printf("inode_reset_entry: can only reset entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < FREE_INODE) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (!inode_valid(sub_inumber)) {
         printf("inode_reset_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == sub_inumber) {
-            inode_table[inumber].data.dirEntries[i].inumber = FREE_INODE;
-            inode_table[inumber].data.dirEntries[i].name[0] = '\0';
-            return SUCCESS;
-        }
+    DirTable *dir = inode->data.dir;
+    int s = dir_find_slot(dir, sub_name, len, name_hash(sub_name, len));
+    if (s == FAIL || dir->entries[dir->slots[s]].inumber != sub_inumber)
+        return FAIL;
+
+    /* move the last entry into the hole to keep entries packed */
+    int pos = dir->slots[s], last = dir->num_entries - 1;
+    inode_snapshot_save(inumber, inode);
+    inode_mark_dirty(inumber, inode);
+    inode_write_begin(inode);
+    dir->slots[s] = DELETED_ENTRY;
+    dir->num_deleted++;
+    if (pos != last) {
+        dir->slots[dir_find_pos_slot(dir, last)] = pos;
+        dir->entries[pos] = dir->entries[last];
     }
-    return FAIL;
+    dir->num_entries--;
+    inode_write_end(inode);
+    return SUCCESS;
 }
 
 
@@ -213,47 +1158,459 @@ int dir_reset_entry(int inumber, int sub_inumber) {
  * Input:
  *  - inumber: identifier of the i-node
  *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry 
+ *  - sub_name, len: name of the sub i-node entry
  * Returns: SUCCESS or FAIL
  */
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
+int dir_add_entry(int inumber, int sub_inumber, const char *sub_name, int len) {
     /* Used for testing synchronization speedup */
     //insert_delay(DELAY);
 
-    if ((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].nodeType == T_NONE)) {
+    if (!inode_valid(inumber)) {
         printf("inode_add_entry: invalid inumber\n");
         return FAIL;
     }
 
-    if (inode_table[inumber].nodeType != T_DIRECTORY) {
+    inode_t *inode = inode_at(inumber);
+    if (inode->nodeType != T_DIRECTORY) {
         printf("inode_add_entry: can only add entry to directories\n");
         return FAIL;
     }
 
-    if ((sub_inumber < 0) || (sub_inumber > INODE_TABLE_SIZE) || (inode_table[sub_inumber].nodeType == T_NONE)) {
+    if (!inode_valid(sub_inumber)) {
         printf("inode_add_entry: invalid entry inumber\n");
         return FAIL;
     }
 
-    if (strlen(sub_name) == 0 ) {
+    if (len == 0 ) {
         printf("inode_add_entry: \
                entry name must be non-empty\n");
         return FAIL;
     }
-    
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (inode_table[inumber].data.dirEntries[i].inumber == FREE_INODE) {
-            inode_table[inumber].data.dirEntries[i].inumber = sub_inumber;
-            strcpy(inode_table[inumber].data.dirEntries[i].name, sub_name);
-            return SUCCESS;
+
+    if (len >= MAX_FILE_NAME) {
+        printf("inode_add_entry: entry name too long\n");
+        return FAIL;
+    }
+
+    inode_snapshot_save(inumber, inode);
+    inode_mark_dirty(inumber, inode);
+    inode_write_begin(inode);
+    DirTable *dir = inode->data.dir;
+    int max_entries = dir_max_entries(dir->num_slots), room = dir_name_room(len);
+    if (dir->num_entries == max_entries) {
+        /* full: double the table */
+        dir = dir_table_rebuild(dir, dir->num_slots * 2, room);
+    }
+    else if (dir->num_entries + dir->num_deleted >= max_entries ||
+             dir->names_used + room > dir->names_size) {
+        /* too many deleted slots make probe chains long, or the name pool
+           is full: clean them up */
+        dir = dir_table_rebuild(dir, dir->num_slots, room);
+    }
+    __atomic_store_n(&inode->data.dir, dir, __ATOMIC_RELEASE);
+
+    int pos = dir->num_entries;
+    DirEntry *entry = &dir->entries[pos];
+    entry->inumber = sub_inumber;
+    entry->hash = name_hash(sub_name, len);
+    dir_entry_set_name(dir, entry, sub_name, len);
+    dir_insert_slot(dir, pos);
+    dir->num_entries++;
+    inode_write_end(inode);
+    /* the cached paths missing below the directory become stale */
+    __atomic_add_fetch(&inode->child_gen, 1, __ATOMIC_SEQ_CST);
+    return SUCCESS;
+}
+
+
+/*
+ * Starts a snapshot of the namespace: until snapshot_end, inode_print_tree
+ * and inode_snapshot_get show the fs as it is now, whatever changes are
+ * made meanwhile.
+ * Must be called while no critical command is running, and only one
+ * snapshot may be active at a time.
+ */
+void snapshot_begin() {
+    snapshot_gen++;
+    snapshot_active = 1;
+}
+
+
+/*
+ * Ends the active snapshot and releases the states saved for it.
+ * Must be called while no critical command is running.
+ */
+void snapshot_end() {
+    snapshot_active = 0;
+
+    for (int inumber = snapshot_saved; inumber != FREE_INODE; ) {
+        inode_t *inode = inode_at(inumber);
+        if (inode->snap_dir)
+            free(inode->snap_dir);
+        inode->snap_dir = NULL;
+        inumber = inode->snap_next;
+    }
+    snapshot_saved = FREE_INODE;
+}
+
+
+/*
+ * Starts a new generation of changed i-nodes, for a checkpoint of the
+ * snapshot being started. Must be called while no critical command is
+ * running.
+ * Returns: the first i-node changed during the generation that ended,
+ *          or FREE_INODE; inode_dirty_next gives the others
+ */
+int inode_dirty_take() {
+    int head = dirty_heads[dirty_gen & 1];
+
+    dirty_gen++;
+    dirty_heads[dirty_gen & 1] = FREE_INODE;
+    return head;
+}
+
+
+/*
+ * Returns the i-node after the given one in the list returned by the
+ * last inode_dirty_take, or FREE_INODE.
+ */
+int inode_dirty_next(int inumber) {
+    return inode_at(inumber)->dirty_next[(dirty_gen - 1) & 1];
+}
+
+
+/*
+ * Reads an i-node as seen by the active snapshot, if there is one. The
+ * i-node is only read locked while its entries are copied.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - nType: filled with the type of the i-node
+ * Returns: a copy of the entries of a directory, for the caller to free,
+ *          or NULL for any other i-node
+ */
+DirTable *inode_snapshot_get(int inumber, type *nType) {
+    inode_t *inode = inode_at(inumber);
+    DirTable *entries = NULL;
+    DirTable *dir;
+
+    inode_lock(inumber, 'r');
+    if (snapshot_active && inode->snap_gen == snapshot_gen) {
+        *nType = inode->snap_type;
+        dir = inode->snap_dir;
+    }
+    else {
+        *nType = inode->nodeType;
+        dir = inode->data.dir;
+    }
+    if (*nType == T_DIRECTORY)
+        entries = dir_table_clone(dir);
+    inode_unlock(inumber);
+    return entries;
+}
+
+
+static int print_tree(FILE *fp, int inumber, char *path, int len);
+
+/*
+ * Prints the subtrees of the entries of a directory, from first to last.
+ * Input:
+ *  - fp: file to output
+ *  - entries: the entries of the directory
+ *  - first, last: range of the entries to print
+ *  - path: buffer of MAX_PATH_SIZE bytes holding the directory's path
+ *  - len: length of the path
+ * Returns: SUCCESS or FAIL
+ */
+static int print_entries(FILE *fp, DirTable *entries, int first, int last,
+                         char *path, int len) {
+    int res = SUCCESS;
+
+    for (int i = first; i < last; i++) {
+        DirEntry *entry = &entries->entries[i];
+        if (len + 1 + entry->len >= MAX_PATH_SIZE) {
+            fprintf(stderr, "truncation when building full path\n");
+            res = FAIL;
+            break;
+        }
+        path[len] = '/';
+        memcpy(path + len + 1, dir_entry_name(entries, entry), entry->len);
+        path[len + 1 + entry->len] = '\0';
+        if ( print_tree(fp, entry->inumber, path, len + 1 + entry->len) == FAIL ) {
+            res = FAIL;
+            break;
+        }
+    }
+    path[len] = '\0';
+    return res;
+}
+
+
+/*
+ * Prints the subtree of an i-node, as seen by the active snapshot if
+ * there is one. Each i-node is only read locked while its entries are
+ * copied, so the output is written without holding any lock.
+ * The whole walk builds paths in a single buffer: each level appends
+ * its names to the path it was given and cuts them off again.
+ * Input:
+ *  - fp: file to output
+ *  - inumber: identifier of the i-node
+ *  - path: buffer of MAX_PATH_SIZE bytes holding the i-node's path
+ *  - len: length of the path
+ * Returns: SUCCESS or FAIL
+ */
+static int print_tree(FILE *fp, int inumber, char *path, int len) {
+    int res = SUCCESS;
+    type nType;
+    DirTable *entries = inode_snapshot_get(inumber, &nType);
+
+    if (nType == T_FILE || nType == T_DIRECTORY) {
+        fprintf(fp, "%s\n", path);
+    }
+
+    if (entries != NULL)
+        res = print_entries(fp, entries, 0, entries->num_entries, path, len);
+    free(entries);
+    return res;
+}
+
+
+/*
+ * A piece of a tree being printed, rendered by a print thread into its
+ * own buffer: the line of a directory, a whole subtree, or the subtrees
+ * of a range of the entries of a directory.
+ */
+typedef struct print_task {
+    int inumber;
+    char *path;
+    int len;
+    int line_only;
+    DirTable *entries;  /* for a range: the entries of the directory */
+    int first, last;    /* and the range of them to print */
+    int done;
+    int res;            /* RETRY if the thread could not render it */
+    char *buf;
+    size_t size;
+} print_task;
+
+/* Tasks of the running print, and the next one to render */
+static print_task *print_tasks;
+static int print_num_tasks;
+static int print_next_task;
+static pthread_mutex_t print_tasks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t print_task_done = PTHREAD_COND_INITIALIZER;
+
+
+/*
+ * Adds a task to a list of print tasks, which must have room for it.
+ * Returns: SUCCESS or FAIL if the path would be too long or there is no
+ *          memory for it
+ */
+static int print_task_add(print_task *tasks, int *num, int inumber,
+                          const char *path, int len, const char *name, int name_len,
+                          int line_only) {
+    int path_len = name != NULL ? len + 1 + name_len : len;
+    print_task *task = &tasks[*num];
+
+    if (path_len >= MAX_PATH_SIZE)
+        return FAIL;
+
+    memset(task, 0, sizeof(*task));
+    task->inumber = inumber;
+    task->line_only = line_only;
+    task->len = path_len;
+    if ((task->path = malloc(path_len + 1)) == NULL)
+        return FAIL;
+    memcpy(task->path, path, len);
+    if (name != NULL) {
+        task->path[len] = '/';
+        memcpy(task->path + len + 1, name, name_len);
+    }
+    task->path[path_len] = '\0';
+    (*num)++;
+    return SUCCESS;
+}
+
+
+/*
+ * Frees a list of print tasks.
+ */
+static void print_tasks_free(print_task *tasks, int num) {
+    for (int t = 0; t < num; t++) {
+        free(tasks[t].buf);
+        free(tasks[t].path);
+        /* the ranges of a directory share its entries, owned by the first */
+        if (tasks[t].entries != NULL && tasks[t].first == 0)
+            free(tasks[t].entries);
+    }
+}
+
+
+/*
+ * Splits a print task of a directory, at the end of a list of tasks: in
+ * the line of the directory and a subtree per entry or, with more
+ * entries than room, in ranges of them.
+ * Input:
+ *  - next, next_num: the list of tasks
+ *  - task: the task of the directory
+ *  - entries: the entries of the directory, which the ranges keep
+ *  - room: most tasks that may be added besides the line, at least 1
+ * Returns: SUCCESS, or FAIL leaving the list as it was
+ */
+static int print_task_split(print_task *next, int *next_num, print_task *task,
+                            DirTable *entries, int room) {
+    int n = entries->num_entries, start = *next_num;
+    int ranges = n > room ? room : 0, res;
+
+    res = print_task_add(next, next_num, task->inumber, task->path, task->len, NULL, 0, 1);
+    for (int i = 0; i < ranges && res == SUCCESS; i++) {
+        res = print_task_add(next, next_num, task->inumber, task->path, task->len, NULL, 0, 0);
+        if (res == SUCCESS) {
+            next[*next_num - 1].entries = entries;
+            next[*next_num - 1].first = (long) n * i / ranges;
+            next[*next_num - 1].last = (long) n * (i + 1) / ranges;
+        }
+    }
+    for (int i = 0; i < n && !ranges && res == SUCCESS; i++) {
+        DirEntry *entry = &entries->entries[i];
+        res = print_task_add(next, next_num, entry->inumber, task->path, task->len,
+                             dir_entry_name(entries, entry), entry->len, 0);
+    }
+
+    if (res == FAIL) {
+        /* the entries go back to the caller */
+        for (int t = start; t < *next_num; t++)
+            next[t].entries = NULL;
+        print_tasks_free(next + start, *next_num - start);
+        *next_num = start;
+    }
+    return res;
+}
+
+
+/*
+ * Splits the top of a tree into print tasks, in the order the walk
+ * prints them: each round replaces the subtrees of directories by the
+ * line of the directory and the subtrees of its entries, until there are
+ * as many tasks as the target. A directory with more entries than there
+ * is room for is split in ranges of entries instead, which are not split
+ * further. A subtree that can't be split (a path too long, no memory) is
+ * left whole, for the thread to print like the sequential walk would.
+ * Returns: SUCCESS, or FAIL if there is no memory for any task
+ */
+static int print_tasks_split(int inumber, char *name, int target) {
+    print_task *tasks, *next;
+    int num = 0;
+
+    if ((tasks = malloc(sizeof(print_task) * target)) == NULL)
+        return FAIL;
+    if (print_task_add(tasks, &num, inumber, name, strlen(name), NULL, 0, 0) == FAIL) {
+        free(tasks);
+        return FAIL;
+    }
+
+    /* there are never more than target tasks: each split only takes the
+     * room left by the tasks before it and one for each after it */
+    for (int round = 0; round < PRINT_SPLIT_ROUNDS && num < target; round++) {
+        int next_num = 0, split = 0;
+
+        if ((next = malloc(sizeof(print_task) * target)) == NULL)
+            break;
+        for (int t = 0; t < num; t++) {
+            print_task *task = &tasks[t];
+            int room = target - next_num - (num - t);
+            DirTable *entries = NULL;
+            type nType;
+
+            if (!task->line_only && task->entries == NULL && room > 0)
+                entries = inode_snapshot_get(task->inumber, &nType);
+            if (entries == NULL ||
+                print_task_split(next, &next_num, task, entries, room) == FAIL) {
+                free(entries);
+                next[next_num++] = *task;
+                continue;
+            }
+
+            split = 1;
+            /* kept by the ranges, if there are any */
+            if (entries->num_entries <= room)
+                free(entries);
+            free(task->path);
         }
+        free(tasks);
+        tasks = next;
+        num = next_num;
+        if (!split)
+            break;
     }
-    return FAIL;
+
+    print_tasks = tasks;
+    print_num_tasks = num;
+    print_next_task = 0;
+    return SUCCESS;
+}
+
+
+/*
+ * Renders a print task.
+ * Input:
+ *  - fp: file to output
+ *  - task: the task
+ * Returns: SUCCESS or FAIL
+ */
+static int print_task_render(FILE *fp, print_task *task) {
+    char path[MAX_PATH_SIZE];
+
+    memcpy(path, task->path, task->len + 1);
+    if (task->entries != NULL)
+        return print_entries(fp, task->entries, task->first, task->last, path, task->len);
+    return print_tree(fp, task->inumber, path, task->len);
+}
+
+
+/*
+ * Print thread: renders the subtrees of the print tasks, one at a time,
+ * each into a buffer of its own. A task without memory for its buffer is
+ * left to inode_print_tree.
+ */
+static void *print_worker(void *arg) {
+    while (1) {
+        int t = __atomic_fetch_add(&print_next_task, 1, __ATOMIC_RELAXED);
+        if (t >= print_num_tasks)
+            break;
+
+        print_task *task = &print_tasks[t];
+        int res = SUCCESS;
+        if (!task->line_only) {
+            FILE *fp = open_memstream(&task->buf, &task->size);
+            if (fp == NULL) {
+                res = RETRY;
+            }
+            else {
+                res = print_task_render(fp, task);
+                if (fclose(fp) != 0)
+                    res = RETRY;
+            }
+            if (res == RETRY) {
+                free(task->buf);
+                task->buf = NULL;
+            }
+        }
+
+        pthread_mutex_lock(&print_tasks_lock);
+        task->res = res;
+        task->done = 1;
+        pthread_cond_broadcast(&print_task_done);
+        pthread_mutex_unlock(&print_tasks_lock);
+    }
+    return NULL;
 }
 
 
 /*
- * Prints the i-nodes table.
+ * Prints the i-nodes table, as seen by the active snapshot if there is one.
+ * With several cpus, the top of the tree is split in subtrees that print
+ * threads render at once, and their output is written in the order of
+ * the walk, as soon as each one is ready. Only one print runs at a time.
  * Input:
  *  - fp: file to output
  *  - inumber: identifier of the i-node
@@ -263,26 +1620,65 @@ int dir_add_entry(int inumber, int sub_inumber, char *sub_name) {
  *  - either SUCCESS or FAIL
  */
 int inode_print_tree(FILE *fp, int inumber, char *name) {
+    pthread_t threads[PRINT_MAX_THREADS];
+    char path[MAX_PATH_SIZE];
+    int cpus = cpus_available();
+    int num_threads = cpus < PRINT_MAX_THREADS ? cpus : PRINT_MAX_THREADS;
+    int len = strlen(name), started = 0, res = SUCCESS;
 
-    if (inode_table[inumber].nodeType == T_FILE) {
-        fprintf(fp, "%s\n", name);
-        return SUCCESS;
-    }
-
-    if (inode_table[inumber].nodeType == T_DIRECTORY) {
-        fprintf(fp, "%s\n", name);
-        for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-            if (inode_table[inumber].data.dirEntries[i].inumber != FREE_INODE) {
-                char path[MAX_FILE_NAME];
-                if (snprintf(path, sizeof(path), "%s/%s", name, inode_table[inumber].data.dirEntries[i].name) > sizeof(path)) {
-                    fprintf(stderr, "truncation when building full path\n");
-                    return FAIL;
-                }
-                if ( inode_print_tree(fp, inode_table[inumber].data.dirEntries[i].inumber, path) == FAIL ) {
-                    return FAIL;
-                }
-            }
+    if (len >= MAX_PATH_SIZE)
+        return FAIL;
+    /* without threads or memory for the tasks, the tree is walked here */
+    if (num_threads < 2 ||
+        print_tasks_split(inumber, name, num_threads * PRINT_TASKS_PER_THREAD) == FAIL) {
+        memcpy(path, name, len + 1);
+        return print_tree(fp, inumber, path, len);
+    }
+
+    for (started = 0; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, print_worker, NULL) != 0)
+            break;
+    }
+    if (started == 0) {
+        print_tasks_free(print_tasks, print_num_tasks);
+        free(print_tasks);
+        print_tasks = NULL;
+        memcpy(path, name, len + 1);
+        return print_tree(fp, inumber, path, len);
+    }
+
+    for (int t = 0; t < print_num_tasks && res == SUCCESS; t++) {
+        print_task *task = &print_tasks[t];
+
+        pthread_mutex_lock(&print_tasks_lock);
+        while (!task->done)
+            pthread_cond_wait(&print_task_done, &print_tasks_lock);
+        pthread_mutex_unlock(&print_tasks_lock);
+
+        if (task->line_only)
+            fprintf(fp, "%s\n", task->path);
+        else if (task->res == RETRY)
+            res = print_task_render(fp, task);
+        else {
+            fwrite(task->buf, 1, task->size, fp);
+            res = task->res;
+        }
+        if (res == FAIL) {
+            /* the threads stop at the task they are rendering */
+            __atomic_store_n(&print_next_task, print_num_tasks, __ATOMIC_RELAXED);
         }
+        free(task->buf);
+        task->buf = NULL;
     }
-    return SUCCESS;
-}
\ No newline at end of file
+
+    for (int i = 0; i < started; i++) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            perror("Error: failed to join print thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    print_tasks_free(print_tasks, print_num_tasks);
+    free(print_tasks);
+    print_tasks = NULL;
+    return res;
+}
@@ -3,35 +3,120 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "../tecnicofs-api-constants.h"
 
 /* FS root inode number */
 #define FS_ROOT 0
 
 #define FREE_INODE -1
-#define INODE_TABLE_SIZE 50
-#define MAX_DIR_ENTRIES 20
+/* Marks a hash slot whose entry was removed */
+#define DELETED_ENTRY -2
+/* Number of hash slots of a new directory (a power of 2) */
+#define DIR_INITIAL_SLOTS 8
+
+/*
+ * The inode table is made of chunks of INODE_CHUNK_SIZE i-nodes that are
+ * allocated on demand. Chunks are never moved or freed while the fs is
+ * running, so i-node addresses (and their locks) stay valid.
+ */
+#define INODE_CHUNK_BITS 10
+#define INODE_CHUNK_SIZE (1 << INODE_CHUNK_BITS)
+#define INODE_MAX_CHUNKS 8192
+#define INODE_TABLE_SIZE (INODE_CHUNK_SIZE * INODE_MAX_CHUNKS)
+
+/* Maximum number of components in a path (bounds the locks held by a lookup) */
+#define MAX_PATH_DEPTH (MAX_PATH_SIZE / 2 + 1)
 
 #define SUCCESS 0
 #define FAIL -1
+/* An optimistic read saw a concurrent change and must be redone */
+#define RETRY -2
 
 #define DELAY 5000
 
 
+/* Names shorter than this are kept in the entry itself */
+#define DIR_INLINE_NAME 22
+
 /*
- * Contains the name of the entry and respective i-number
+ * Contains the name of the entry and respective i-number.
+ * Short names are stored in place; longer ones in the name pool of the
+ * directory table, so an entry takes 32 bytes whatever its name.
  */
 typedef struct dirEntry {
-	char name[MAX_FILE_NAME];
 	int inumber;
+	unsigned int hash;   /* cached hash of name */
+	unsigned short len;  /* length of name */
+	union {
+		char str[DIR_INLINE_NAME]; /* len < DIR_INLINE_NAME: the name itself */
+		unsigned int offset;       /* otherwise: position of the name in the pool */
+	} name;
 } DirEntry;
 
 /*
- * Data is either text (file) or entries (DirEntry)
+ * Entries of a directory. They are kept packed at the start of entries and
+ * indexed by name through slots, an open-addressed (linear probing) hash
+ * table holding positions in entries, FREE_INODE or DELETED_ENTRY.
+ * Long names are appended to names; the space of removed ones is only
+ * reclaimed when the table is rebuilt.
+ * The table, both arrays and the name pool live in a single allocation,
+ * except for tables loaded from a checkpoint, whose arrays stay in the
+ * checkpoint's mapping.
+ */
+typedef struct dirTable {
+	int num_entries;   /* entries in use */
+	int num_deleted;   /* slots marked DELETED_ENTRY */
+	int num_slots;     /* size of slots, a power of 2 */
+	int names_used;    /* bytes of names taken, live or not */
+	int names_size;    /* size of names */
+	int *slots;
+	DirEntry *entries; /* room for 3/4 of num_slots */
+	char *names;
+} DirTable;
+
+/*
+ * A directory table in a checkpoint image: the counters of the table,
+ * then its slots, entries and name pool, as in memory.
+ */
+typedef struct dirImage {
+	int num_entries;
+	int num_deleted;
+	int num_slots;
+	int names_used;
+	int names_size;
+	int pad;
+} DirImage;
+
+/* Most threads printing a tree, the tasks to split it in for each one,
+ * and most levels of the tree split to get them */
+#define PRINT_MAX_THREADS 8
+#define PRINT_TASKS_PER_THREAD 16
+#define PRINT_SPLIT_ROUNDS 4
+
+/* Size of the blocks that hold a file's contents (a power of 2) */
+#define FILE_BLOCK_BITS 16
+#define FILE_BLOCK_SIZE (1 << FILE_BLOCK_BITS)
+
+/*
+ * Contents of a file: a list of fixed-size blocks, so that a file grows
+ * by adding blocks and the bytes already written never move. A NULL
+ * block is a hole and reads as zeros; the bytes of a block past the end
+ * of the file are always zero.
+ */
+typedef struct fileData {
+	size_t size;
+	int num_blocks; /* blocks covering size */
+	int capacity;   /* room in blocks */
+	char **blocks;
+} FileData;
+
+/*
+ * Data is either contents (file) or entries (DirTable)
  */
 union Data {
-	char *fileContents; /* for files */
-	DirEntry *dirEntries; /* for directories */
+	FileData *file; /* for files */
+	DirTable *dir; /* for directories */
 };
 
 /*
@@ -41,6 +126,19 @@ typedef struct inode_t {
 	type nodeType;
 	union Data data;
 	pthread_rwlock_t lock;
+	int next_free; /* next inumber in the free list, while unused */
+	unsigned int seq; /* odd while the i-node is being changed */
+	int open_count; /* descriptors referring to the i-node; it cannot be deleted while open */
+	/* state saved for the running snapshot, see snapshot_begin */
+	unsigned int snap_gen; /* snapshot the state was saved for */
+	type snap_type;
+	DirTable *snap_dir;
+	int snap_next; /* next i-node in the list of saved i-nodes */
+	/* changes since the last checkpoint, see inode_dirty_take */
+	unsigned int dirty_gen; /* generation the i-node last changed in */
+	int dirty_next[2]; /* next i-node in the list of changed i-nodes, by generation */
+	unsigned int name_gen; /* bumped when the i-node is deleted or moved, see dcache.h */
+	unsigned int child_gen; /* bumped when an entry is added to the directory, see dcache.h */
     /* more i-node attributes will be added in future exercises */
 } inode_t;
 
@@ -53,20 +151,47 @@ typedef struct inode_t {
 typedef struct save_locks {
 	int inumber;
 	int num_locks;
- 	int locks_numbers[INODE_TABLE_SIZE];
+ 	int locks_numbers[MAX_PATH_DEPTH];
 } save_locks;
 
 /* Prototype functions of state.c */
 void insert_delay(int cycles);
+int cpus_available();
+unsigned int name_hash(const char *name, int len);
 void inode_table_init();
 void inode_table_destroy();
+int inode_table_capacity();
+void inode_restore(int inumber, type nType, DirTable *dir);
+void inode_table_restored(int num_inodes);
 int inode_create(type nType, char c);
 int inode_delete(int inumber);
 int inode_get(int inumber, type *nType, union Data *data);
 int inode_set_file(int inumber, char *fileContents, int len);
-int dir_reset_entry(int inumber, int sub_inumber);
-int dir_add_entry(int inumber, int sub_inumber, char *sub_name);
+int inode_file_read(int inumber, char *buf, size_t len, size_t offset);
+int inode_file_write(int inumber, char *buf, size_t len, size_t offset);
+int inode_file_truncate(int inumber, size_t size);
+int inode_file_size(int inumber, size_t *size);
+int dir_reset_entry(int inumber, int sub_inumber, const char *sub_name, int len);
+int dir_add_entry(int inumber, int sub_inumber, const char *sub_name, int len);
+int dir_lookup_entry(DirTable *dir, const char *name, int len);
+long dir_table_write(FILE *fp, DirTable *dir);
+long dir_image_size(char *image, size_t room);
+DirTable *dir_table_map(char *image, size_t room);
+DirTable *inode_snapshot_get(int inumber, type *nType);
+int inode_dirty_take();
+int inode_dirty_next(int inumber);
 int inode_print_tree(FILE *fp, int inumber, char *name);
+void snapshot_begin();
+void snapshot_end();
+int inode_lookup_optimistic(int inumber, unsigned int *seq, const char *name, int len,
+                            unsigned int *name_gen);
+unsigned int inode_name_gen(int inumber);
+void inode_renamed(int inumber);
+unsigned int inode_child_gen(int inumber);
+unsigned int inode_read_begin(int inumber);
+void inode_open(int inumber);
+void inode_close(int inumber);
+int inode_is_open(int inumber);
 void inode_lock(int inumber, char c);
 void inode_unlock(int inumber);
 void unlock_all_nodes(int locks[],int size);
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "wal.h"
+#include "replay.h"
+
+/*
+ * Appenders copy their records into the current buffer; the log thread
+ * swaps the buffers and writes the full one while the other fills up.
+ * LSNs are byte offsets in the log: a record is durable once durable_lsn
+ * reaches the offset of its end.
+ * The log is a series of segments; records go to the last one, which
+ * started at segment_lsn.
+ */
+static int enabled = 0;
+static char data_dir[MAX_PATH_SIZE];
+static int log_fd = -1;
+static unsigned long segment = 0;
+static unsigned long segment_lsn = 0;
+static char *buffers[2];
+static int current = 0;
+static int buffer_len = 0;
+static int stopping = 0;
+static unsigned long appended_lsn = 0;
+static unsigned long durable_lsn = 0;
+
+static pthread_t log_thread;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t has_records = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t has_room = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t synced = PTHREAD_COND_INITIALIZER;
+
+/* end of the last record appended by the calling thread */
+static __thread unsigned long my_lsn = 0;
+
+static uint32_t crc_table[256];
+
+
+/*
+ * Fills the table of the crc32 (IEEE 802.3) checksum.
+ */
+static void crc_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+
+/*
+ * Continues a crc32 over more bytes.
+ * Input:
+ *  - crc: checksum of the bytes so far (0 for none)
+ *  - buf, len: the bytes
+ * Returns: checksum of all the bytes
+ */
+static uint32_t crc_update(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (len-- > 0)
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+/*
+ * Builds the path of a segment of the log.
+ */
+static void segment_path(char *path, unsigned long seg) {
+    if (snprintf(path, MAX_PATH_SIZE, "%s/" WAL_SEGMENT_FORMAT, data_dir, seg) >= MAX_PATH_SIZE) {
+        fprintf(stderr, "Error: data directory path too long\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * Makes the entries of the data directory durable.
+ */
+static void sync_data_dir() {
+    int dir_fd;
+
+    if ((dir_fd = open(data_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+        fsync(dir_fd) < 0 || close(dir_fd) < 0) {
+        perror("Error: failed to sync data directory");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static int segment_compare(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *) a, y = *(const unsigned long *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Lists the segments in the data directory.
+ * Input:
+ *  - num: reference to an int, to store the number of segments
+ * Returns: their numbers, sorted, in an array the caller frees
+ */
+static unsigned long *list_segments(int *num) {
+    unsigned long *segs = NULL;
+    int size = 0;
+    struct dirent *ent;
+    DIR *dir;
+
+    if ((dir = opendir(data_dir)) == NULL) {
+        perror("Error: failed to open data directory");
+        exit(EXIT_FAILURE);
+    }
+    *num = 0;
+    while ((ent = readdir(dir)) != NULL) {
+        unsigned long seg;
+        int len;
+
+        if (sscanf(ent->d_name, WAL_SEGMENT_FORMAT "%n", &seg, &len) != 1 ||
+            ent->d_name[len] != '\0')
+            continue;
+        if (*num == size) {
+            size = size > 0 ? 2 * size : 16;
+            if ((segs = realloc(segs, sizeof(unsigned long) * size)) == NULL) {
+                perror("Error: failed to list log segments");
+                exit(EXIT_FAILURE);
+            }
+        }
+        segs[(*num)++] = seg;
+    }
+    closedir(dir);
+    qsort(segs, *num, sizeof(unsigned long), segment_compare);
+    return segs;
+}
+
+
+/*
+ * Writes the whole buffer to the log.
+ */
+static void write_all(char *buf, int len) {
+    while (len > 0) {
+        int n = write(log_fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            perror("Error: failed to write log");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Log thread: writes and syncs the records appended since its last
+ * write, all at once, and wakes the threads waiting for them.
+ */
+static void *log_writer(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&log_lock);
+        while (buffer_len == 0 && !stopping)
+            pthread_cond_wait(&has_records, &log_lock);
+        if (buffer_len == 0) {
+            pthread_mutex_unlock(&log_lock);
+            break;
+        }
+        char *buf = buffers[current];
+        int len = buffer_len;
+        unsigned long lsn = appended_lsn;
+        current ^= 1;
+        buffer_len = 0;
+        pthread_cond_broadcast(&has_room);
+        pthread_mutex_unlock(&log_lock);
+
+        write_all(buf, len);
+        if (fdatasync(log_fd) < 0) {
+            perror("Error: failed to sync log");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&log_lock);
+        __atomic_store_n(&durable_lsn, lsn, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&synced);
+        pthread_mutex_unlock(&log_lock);
+    }
+    return NULL;
+}
+
+
+/*
+ * Checks a record at the given offset of the log.
+ * Returns: length of the record, or 0 if it is torn or past the end
+ */
+static uint32_t record_check(char *log, size_t size, size_t off) {
+    wal_record rec;
+    uint32_t fields = offsetof(wal_record, op);
+
+    if (size - off < sizeof(rec))
+        return 0;
+    memcpy(&rec, log + off, sizeof(rec));
+    if (rec.length < sizeof(rec) || rec.length > size - off ||
+        rec.path_len == 0 || sizeof(rec) + rec.path_len + rec.new_path_len != rec.length ||
+        crc_update(0, log + off + fields, rec.length - fields) != rec.checksum)
+        return 0;
+    /* both paths must be NUL terminated */
+    if (log[off + sizeof(rec) + rec.path_len - 1] != '\0' ||
+        (rec.new_path_len > 0 && log[off + rec.length - 1] != '\0'))
+        return 0;
+    return rec.length;
+}
+
+
+/*
+ * Segments mapped while the log is replayed, and their records
+ */
+typedef struct segment_map {
+    char *data;
+    size_t size;
+} segment_map;
+
+static segment_map *maps = NULL;
+static int num_maps = 0;
+static replay_item *items = NULL;
+static int num_items = 0;
+static int items_size = 0;
+
+
+/*
+ * Reads the records of a segment of the log, to be replayed. The segment
+ * stays mapped until they are.
+ * Input:
+ *  - fd: the segment
+ *  - last: whether it is the last segment, whose torn tail is cut off; in
+ *          any other a torn record is an error
+ * Returns: size of the segment after its records
+ */
+static size_t read_segment(int fd, int last) {
+    struct stat st;
+    size_t off = 0;
+
+    if (fstat(fd, &st) < 0) {
+        perror("Error: failed to open log");
+        exit(EXIT_FAILURE);
+    }
+    if (st.st_size == 0)
+        return 0;
+
+    /* writable, as replay may rewrite the paths */
+    char *log = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    uint32_t len;
+
+    if (log == MAP_FAILED || (maps = realloc(maps, sizeof(segment_map) * (num_maps + 1))) == NULL) {
+        perror("Error: failed to map log");
+        exit(EXIT_FAILURE);
+    }
+    maps[num_maps].data = log;
+    maps[num_maps++].size = st.st_size;
+    madvise(log, st.st_size, MADV_SEQUENTIAL);
+    while ((len = record_check(log, st.st_size, off)) > 0) {
+        if (num_items == items_size) {
+            items_size = items_size > 0 ? 2 * items_size : 1024;
+            if ((items = realloc(items, sizeof(replay_item) * items_size)) == NULL) {
+                perror("Error: failed to allocate log records");
+                exit(EXIT_FAILURE);
+            }
+        }
+        replay_item *item = &items[num_items++];
+        memset(item, 0, sizeof(*item));
+        memcpy(&item->rec, log + off, sizeof(item->rec));
+        item->path = log + off + sizeof(item->rec);
+        item->new_path = item->rec.new_path_len > 0 ? item->path + item->rec.path_len : NULL;
+        off += len;
+    }
+
+    if (off < st.st_size) {
+        if (!last) {
+            fprintf(stderr, "Error: corrupt record in the middle of the log\n");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "Log: dropping %lu bytes of torn records\n",
+                (unsigned long) (st.st_size - off));
+        if (ftruncate(fd, off) < 0 || fdatasync(fd) < 0) {
+            perror("Error: failed to truncate log");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return off;
+}
+
+
+/*
+ * Opens the log in a data directory, creating both if needed, replays
+ * its records from a segment on (see replay.h) and starts logging. Segments before that
+ * one are removed. A torn record at the end of the log is cut off. Must
+ * be called before the fs serves any command.
+ * Input:
+ *  - dir: data directory
+ *  - first_segment: first segment to replay, the older ones being
+ *                   covered by a checkpoint
+ *  - apply: called for each record, by several threads at once, in an
+ *           order that gives the same result as the log's; the commands
+ *           it runs are not logged again
+ */
+void wal_open(char *dir, unsigned long first_segment, wal_apply apply) {
+    char path[MAX_PATH_SIZE];
+    unsigned long *segs;
+    size_t off = 0;
+    int num, i;
+
+    crc_init();
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("Error: failed to create data directory");
+        exit(EXIT_FAILURE);
+    }
+    if (snprintf(data_dir, sizeof(data_dir), "%s", dir) >= sizeof(data_dir)) {
+        fprintf(stderr, "Error: data directory path too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    segs = list_segments(&num);
+    for (i = 0; i < num && segs[i] < first_segment; i++);
+    segment = first_segment;
+    for (; i < num; i++) {
+        if (segs[i] != segment) {
+            fprintf(stderr, "Error: log segment %lu is missing\n", segment);
+            exit(EXIT_FAILURE);
+        }
+        if (log_fd >= 0)
+            close(log_fd);
+        segment_path(path, segment);
+        if ((log_fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+            perror("Error: failed to open log");
+            exit(EXIT_FAILURE);
+        }
+        off = read_segment(log_fd, i == num - 1);
+        segment++;
+    }
+    free(segs);
+
+    replay_records(items, num_items, apply);
+    for (i = 0; i < num_maps; i++)
+        munmap(maps[i].data, maps[i].size);
+    free(maps);
+    free(items);
+
+    if (log_fd >= 0)
+        segment--;
+    else {
+        segment_path(path, segment);
+        if ((log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+            perror("Error: failed to open log");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (lseek(log_fd, off, SEEK_SET) < 0) {
+        perror("Error: failed to open log");
+        exit(EXIT_FAILURE);
+    }
+    /* the segment's directory entry must be durable too */
+    sync_data_dir();
+    wal_remove_segments(first_segment);
+
+    buffers[0] = malloc(WAL_BUFFER_SIZE);
+    buffers[1] = malloc(WAL_BUFFER_SIZE);
+    if (buffers[0] == NULL || buffers[1] == NULL) {
+        perror("Error: failed to allocate log buffers");
+        exit(EXIT_FAILURE);
+    }
+    appended_lsn = durable_lsn = off;
+    segment_lsn = 0;
+
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        perror("Error: failed to create log thread");
+        exit(EXIT_FAILURE);
+    }
+    enabled = 1;
+}
+
+
+/*
+ * Starts a new segment of the log, once every record appended so far is
+ * durable. Called with the fs quiescent (no record can be appended).
+ * Returns: number of the new segment
+ */
+unsigned long wal_rotate() {
+    char path[MAX_PATH_SIZE];
+    int fd;
+
+    pthread_mutex_lock(&log_lock);
+    while (durable_lsn < appended_lsn)
+        pthread_cond_wait(&synced, &log_lock);
+
+    segment_path(path, segment + 1);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        perror("Error: failed to open log");
+        exit(EXIT_FAILURE);
+    }
+    sync_data_dir();
+    close(log_fd);
+    log_fd = fd;
+    segment++;
+    segment_lsn = appended_lsn;
+    pthread_mutex_unlock(&log_lock);
+    return segment;
+}
+
+
+/*
+ * Removes the segments of the log before a given one.
+ * Input:
+ *  - before: first segment to keep
+ */
+void wal_remove_segments(unsigned long before) {
+    char path[MAX_PATH_SIZE];
+    unsigned long *segs;
+    int num, removed = 0;
+
+    segs = list_segments(&num);
+    for (int i = 0; i < num && segs[i] < before; i++) {
+        segment_path(path, segs[i]);
+        if (unlink(path) < 0 && errno != ENOENT) {
+            perror("Error: failed to remove log segment");
+            exit(EXIT_FAILURE);
+        }
+        removed = 1;
+    }
+    free(segs);
+    if (removed)
+        sync_data_dir();
+}
+
+
+/*
+ * Returns the number of bytes appended to the current segment.
+ */
+unsigned long wal_segment_bytes() {
+    unsigned long bytes;
+
+    pthread_mutex_lock(&log_lock);
+    bytes = appended_lsn - segment_lsn;
+    pthread_mutex_unlock(&log_lock);
+    return bytes;
+}
+
+
+/*
+ * Writes the records still in memory and closes the log.
+ */
+void wal_close() {
+    if (!enabled)
+        return;
+
+    pthread_mutex_lock(&log_lock);
+    stopping = 1;
+    pthread_cond_signal(&has_records);
+    pthread_mutex_unlock(&log_lock);
+    if (pthread_join(log_thread, NULL) != 0) {
+        perror("Error: failed to join log thread");
+        exit(EXIT_FAILURE);
+    }
+
+    close(log_fd);
+    log_fd = -1;
+    free(buffers[0]);
+    free(buffers[1]);
+    enabled = 0;
+}
+
+
+/*
+ * Appends a record to the log. Called with the changed nodes locked;
+ * the record is only durable after wal_sync.
+ * Input:
+ *  - op: kind of record
+ *  - nodeType: type of the created node (WAL_CREATE)
+ *  - path: path of the node
+ *  - new_path: new path of the node (WAL_MOVE), or NULL
+ */
+void wal_log(int op, type nodeType, const char *path, const char *new_path) {
+    wal_record rec;
+    uint32_t fields = offsetof(wal_record, op);
+
+    if (!enabled)
+        return;
+
+    rec.op = op;
+    rec.node_type = nodeType;
+    rec.path_len = strlen(path) + 1;
+    rec.new_path_len = new_path != NULL ? strlen(new_path) + 1 : 0;
+    rec.pad = 0;
+    rec.length = sizeof(rec) + rec.path_len + rec.new_path_len;
+    rec.checksum = crc_update(0, (char *) &rec + fields, sizeof(rec) - fields);
+    rec.checksum = crc_update(rec.checksum, path, rec.path_len);
+    if (new_path != NULL)
+        rec.checksum = crc_update(rec.checksum, new_path, rec.new_path_len);
+
+    pthread_mutex_lock(&log_lock);
+    while (buffer_len + rec.length > WAL_BUFFER_SIZE)
+        pthread_cond_wait(&has_room, &log_lock);
+
+    char *buf = buffers[current] + buffer_len;
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), path, rec.path_len);
+    if (new_path != NULL)
+        memcpy(buf + sizeof(rec) + rec.path_len, new_path, rec.new_path_len);
+    if (buffer_len == 0)
+        pthread_cond_signal(&has_records);
+    buffer_len += rec.length;
+    appended_lsn += rec.length;
+    my_lsn = appended_lsn;
+    pthread_mutex_unlock(&log_lock);
+}
+
+
+/*
+ * Waits until every record appended by the calling thread is durable.
+ * Called before replying to the commands that appended them.
+ */
+void wal_sync() {
+    if (__atomic_load_n(&durable_lsn, __ATOMIC_ACQUIRE) >= my_lsn)
+        return;
+
+    pthread_mutex_lock(&log_lock);
+    while (durable_lsn < my_lsn)
+        pthread_cond_wait(&synced, &log_lock);
+    pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,59 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include "../tecnicofs-api-constants.h"
+
+/*
+ * Write-ahead log of the namespace: every create, delete and move that
+ * succeeds is appended, while the nodes it changed are still locked, so
+ * the log order is an order in which the commands could have run one at
+ * a time. On restart the log is replayed to rebuild the tree.
+ * Records are gathered in memory and a log thread writes and syncs them
+ * in groups: a command's reply waits for its record (wal_sync), but many
+ * commands share each fdatasync.
+ * The log is split in numbered segments: each checkpoint starts a new
+ * one, and the segments before it can then be removed.
+ */
+
+/* Name of the log's segments inside the data directory */
+#define WAL_SEGMENT_FORMAT "wal.%08lu"
+
+/* Size of each of the two in-memory buffers of records */
+#define WAL_BUFFER_SIZE (1 << 20)
+
+/* Kinds of log records */
+enum wal_op {
+    WAL_CREATE = 1,
+    WAL_DELETE,
+    WAL_MOVE
+};
+
+/*
+ * Record header, followed by the path and, for WAL_MOVE, the new path,
+ * each with its terminating NUL. A record whose checksum does not match
+ * marks the end of the log (a write torn by a crash).
+ */
+typedef struct wal_record {
+    uint32_t length;       /* of the whole record, header included */
+    uint32_t checksum;     /* crc32 of everything after this field */
+    uint8_t op;
+    uint8_t node_type;     /* type of the node, for WAL_CREATE */
+    uint16_t path_len;     /* NUL included */
+    uint16_t new_path_len; /* NUL included, 0 unless WAL_MOVE */
+    uint16_t pad;
+} wal_record;
+
+/* Called by wal_open for each record of the log, from several threads (see replay.h) */
+typedef void (*wal_apply)(wal_record *rec, char *path, char *new_path);
+
+/* Prototype functions of wal.c */
+void wal_open(char *dir, unsigned long first_segment, wal_apply apply);
+void wal_close();
+unsigned long wal_rotate();
+void wal_remove_segments(unsigned long before);
+unsigned long wal_segment_bytes();
+void wal_log(int op, type nodeType, const char *path, const char *new_path);
+void wal_sync();
+
+#endif /* WAL_H */
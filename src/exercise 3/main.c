@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
@@ -11,47 +12,86 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
-#include <unistd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
 #include "fs/operations.h"
-#define MAX_INPUT_SIZE 100
+#include "fs/wal.h"
+#include "fs/checkpoint.h"
+#include "tecnicofs-protocol.h"
+
+/* Size of the input and output buffers of a connection (two full frames) */
+#define CONN_BUFFER_SIZE (2 * (FRAME_HEADER_SIZE + MAX_FRAME_SIZE))
+/* Maximum number of connections waiting for a worker */
+#define MAX_READY 1024
+/* Maximum number of events handled per epoll_wait */
+#define MAX_EVENTS 64
+
+/*
+ * An open file of a connection. The descriptor holds a reference to the
+ * i-node, so the inumber stays valid and file commands skip the path.
+ */
+typedef struct openFile {
+    int inumber; /* FREE_INODE if the descriptor is not in use */
+    permission mode;
+} openFile;
+
+/*
+ * A client connection: requests are read into in, and the replies to
+ * all the complete requests found there are gathered in out and sent
+ * with a single write.
+ * The connection is registered in epoll with EPOLLONESHOT, so it is
+ * either waiting in epoll, being read by the event loop, or being served
+ * by exactly one worker; its requests are thus applied in order.
+ */
+typedef struct connection {
+    int fd;
+    int closing; /* client closed its end; close once the requests are served */
+    int binary;  /* negotiated the binary protocol */
+    openFile files[MAX_OPEN_FILES];
+    int passed_fd; /* descriptor received from the client, until OP_ATTACH takes it */
+    char *shm;     /* ring shared with the client, or NULL */
+    int in_len;
+    int out_len;
+    char in[CONN_BUFFER_SIZE];
+    char out[CONN_BUFFER_SIZE];
+} connection;
 
 int numberThreads = 0;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+int listenfd, epollfd;
+
+// connections with complete requests, waiting for a worker
+connection *readyConns[MAX_READY];
+int numberReady = 0, insertPtr = 0, removePtr = 0;
+pthread_mutex_t readyLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t canInsert = PTHREAD_COND_INITIALIZER, canRemove = PTHREAD_COND_INITIALIZER;
 
 void errorParse(){
     perror("Error: command invalid");
     exit(EXIT_FAILURE);
 }
 
-int applyCommands(char* command){
-        
+/*
+ * Applies a decoded request to the fs.
+ * Input:
+ *  - token: command letter ('c', 'l', 'd', 'm' or 'p')
+ *  - name: first argument (path)
+ *  - arg2: second argument (node type for 'c', new path for 'm')
+ * Returns: result of the command
+ */
+int applyRequest(char token, char* name, char* arg2){
+
     int res;
-    
-    if (command == NULL){
+
+    // the fs bounds the depth of a walk by the longest path
+    if (strlen(name) >= MAX_PATH_SIZE || (arg2 != NULL && strlen(arg2) >= MAX_PATH_SIZE)) {
+        fprintf(stderr, "Error: path too long\n");
         return FAIL;
-    }  
-    
-    if ( pthread_mutex_lock(&mutex) != SUCCESS ) {
-        perror("Error: failed to lock");
-        exit(EXIT_FAILURE);
-    } 
-    char token;
-    char name[MAX_INPUT_SIZE];
-    char arg2[MAX_INPUT_SIZE];
-    int numTokens;
-    if ( (numTokens = sscanf(command, "%c %s %s", &token, name, arg2)) == EOF ) {
-        perror("Error: sscanf fail");
-        exit(EXIT_FAILURE);
     }
-    if ( pthread_mutex_unlock(&mutex) != SUCCESS ) {
-        perror("Error: failed to unlock");
-        exit(EXIT_FAILURE);
-    } 
-    
-    if (numTokens < 2) {
-        perror("Error: invalid command in Queue");
-        exit(EXIT_FAILURE);
-    }  
+
     switch (token) {
         case 'c':
             switch (arg2[0]) {
@@ -64,8 +104,8 @@ int applyCommands(char* command){
                     res = create(name, T_DIRECTORY);
                     break;
                 default:
-                    perror("Error: invalid node type");
-                    exit(EXIT_FAILURE);
+                    fprintf(stderr, "Error: invalid node type\n");
+                    res = FAIL;
             }
             break;
         case 'l': 
@@ -88,13 +128,205 @@ int applyCommands(char* command){
             res = print_tecnicofs_tree(name);
             break;
         default: { /* error */
-            perror("Error: command to apply");
-            exit(EXIT_FAILURE);
+            fprintf(stderr, "Error: command to apply\n");
+            res = FAIL;
         }
     }
     return res;
 }
 
+/* Command letter of each binary opcode */
+static const char tokens[] = { [OP_CREATE] = 'c', [OP_DELETE] = 'd',
+    [OP_LOOKUP] = 'l', [OP_MOVE] = 'm', [OP_PRINT] = 'p' };
+
+/*
+ * Parses a text command in place and applies it. Tokens are split with
+ * strtok_r on the caller's buffer, so no lock or copy is needed.
+ */
+int applyCommands(char* command){
+    char *saveptr, *token, *name, *arg2;
+
+    if (command == NULL){
+        return FAIL;
+    }
+
+    if ( (token = strtok_r(command, " \t\n", &saveptr)) == NULL ||
+         (name = strtok_r(NULL, " \t\n", &saveptr)) == NULL ) {
+        fprintf(stderr, "Error: invalid command\n");
+        return FAIL;
+    }
+    arg2 = strtok_r(NULL, " \t\n", &saveptr);
+
+    if ( strlen(token) != 1 || ((token[0] == 'c' || token[0] == 'm') && arg2 == NULL) ) {
+        fprintf(stderr, "Error: invalid command\n");
+        return FAIL;
+    }
+    return applyRequest(token[0], name, arg2);
+}
+
+/*
+ * Decodes one binary request in place.
+ * Input:
+ *  - payload: buffer holding the request
+ *  - len: size of the buffer
+ *  - off: offset of the request, advanced past it
+ *  - header: filled with the request header
+ *  - args: filled with the arguments (the node type, for OP_CREATE)
+ *  - nodeType: storage for the node type argument
+ * Returns: SUCCESS or FAIL (malformed request)
+ */
+int decodeRequest(char* payload, uint32_t len, uint32_t* off,
+                  tfs_request_header* header, char* args[2], char nodeType[2]){
+
+    args[0] = args[1] = NULL;
+    if (len - *off < sizeof(tfs_request_header))
+        return FAIL;
+    memcpy(header, payload + *off, sizeof(tfs_request_header));
+    *off += sizeof(tfs_request_header);
+    if ((header->opcode < OP_CREATE || header->opcode > OP_PRINT) && header->opcode != OP_OPEN)
+        return FAIL;
+    if (header->num_args < 1 || header->num_args > 2)
+        return FAIL;
+
+    // arguments are used in place, they carry their own NUL
+    for (int i = 0; i < header->num_args; i++) {
+        uint16_t arg_len;
+        if (len - *off < ARG_HEADER_SIZE)
+            return FAIL;
+        memcpy(&arg_len, payload + *off, ARG_HEADER_SIZE);
+        *off += ARG_HEADER_SIZE;
+        if (arg_len == 0 || len - *off < arg_len || payload[*off + arg_len - 1] != '\0')
+            return FAIL;
+        args[i] = payload + *off;
+        *off += arg_len;
+    }
+
+    if (header->opcode == OP_CREATE) {
+        nodeType[0] = header->node_type;
+        nodeType[1] = '\0';
+        args[1] = nodeType;
+    }
+    else if (header->opcode == OP_MOVE && args[1] == NULL)
+        return FAIL;
+    return SUCCESS;
+}
+
+/*
+ * Opens a file for a connection.
+ * Input:
+ *  - name: path of the file
+ *  - mode: permission asked for
+ * Returns: the descriptor, or an error
+ */
+int openDescriptor(connection *conn, char *name, permission mode) {
+    int fd, inumber;
+
+    if (mode != READ && mode != WRITE && mode != RW)
+        return TECNICOFS_ERROR_INVALID_MODE;
+    if (strlen(name) >= MAX_PATH_SIZE)
+        return TECNICOFS_ERROR_OTHER;
+
+    for (fd = 0; fd < MAX_OPEN_FILES && conn->files[fd].inumber != FREE_INODE; fd++);
+    if (fd == MAX_OPEN_FILES)
+        return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+
+    printf("Open: %s\n", name);
+    if ((inumber = open_file(name)) == FAIL)
+        return TECNICOFS_ERROR_FILE_NOT_FOUND;
+    conn->files[fd].inumber = inumber;
+    conn->files[fd].mode = mode;
+    return fd;
+}
+
+/*
+ * Finds the file behind a descriptor.
+ * Input:
+ *  - fd: the descriptor
+ *  - mode: permission the command needs
+ * Returns: the file's inumber, or an error
+ */
+int fileDescriptor(connection *conn, int fd, permission mode) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || conn->files[fd].inumber == FREE_INODE)
+        return TECNICOFS_ERROR_FILE_NOT_OPEN;
+    if ((conn->files[fd].mode & mode) != mode)
+        return TECNICOFS_ERROR_INVALID_MODE;
+    return conn->files[fd].inumber;
+}
+
+/*
+ * Closes a descriptor, which must be open.
+ */
+void closeDescriptor(connection *conn, int fd) {
+    close_file(conn->files[fd].inumber);
+    conn->files[fd].inumber = FREE_INODE;
+}
+
+/*
+ * Applies a decoded binary request.
+ * Returns: result of the command
+ */
+int applyDecoded(connection *conn, tfs_request_header* header, char* args[2]){
+    if (header->opcode == OP_OPEN)
+        return openDescriptor(conn, args[0], header->node_type);
+    return applyRequest(tokens[header->opcode], args[0], args[1]);
+}
+
+/*
+ * Decodes a binary request and applies it.
+ * Input:
+ *  - payload: the request frame's payload
+ *  - len: size of the payload
+ *  - reply: filled with the request id and result
+ * Returns: SUCCESS or FAIL (malformed request)
+ */
+int applyBinary(connection *conn, char* payload, uint32_t len, tfs_reply* reply){
+    tfs_request_header header;
+    char *args[2], nodeType[2];
+    uint32_t off = 0;
+
+    if (decodeRequest(payload, len, &off, &header, args, nodeType) == FAIL)
+        return FAIL;
+
+    reply->request_id = header.request_id;
+    reply->status = applyDecoded(conn, &header, args);
+    return SUCCESS;
+}
+
+/*
+ * Applies the requests of a batch back to back.
+ * Input:
+ *  - payload: the batch frame's payload
+ *  - len: size of the payload
+ *  - reply: filled with the batch id, the number of requests and their
+ *    results, in order
+ * Returns: size of the reply, or FAIL (malformed batch)
+ */
+int applyBatch(connection *conn, char* payload, uint32_t len, char* reply){
+    tfs_request_header batch, header;
+    tfs_reply head;
+    char *args[2], nodeType[2];
+    uint32_t off = sizeof(tfs_request_header);
+    int32_t res;
+
+    if (len < off)
+        return FAIL;
+    memcpy(&batch, payload, sizeof(batch));
+    if (batch.num_args > MAX_BATCH_OPS)
+        return FAIL;
+
+    for (int i = 0; i < batch.num_args; i++) {
+        if (decodeRequest(payload, len, &off, &header, args, nodeType) == FAIL)
+            return FAIL;
+        res = applyDecoded(conn, &header, args);
+        memcpy(reply + sizeof(tfs_reply) + i * sizeof(int32_t), &res, sizeof(res));
+    }
+
+    head.request_id = batch.request_id;
+    head.status = batch.num_args;
+    memcpy(reply, &head, sizeof(head));
+    return sizeof(tfs_reply) + batch.num_args * sizeof(int32_t);
+}
+
 int setSockAddrUn(char *path, struct sockaddr_un *addr) {
 
     if (addr == NULL)
@@ -107,46 +339,594 @@ int setSockAddrUn(char *path, struct sockaddr_un *addr) {
     return SUN_LEN(addr);
 }
 
-void* threadfn(void* sockfd_aux){
-    
-    int sockfd = *((int*)sockfd_aux);
-    struct sockaddr_un client_addr;
-    socklen_t addrlen;
-    char in_buffer[MAX_INPUT_SIZE], out_buffer[MAX_INPUT_SIZE];
-    int c;
+/*
+ * Writes the whole buffer to a socket. A client that went away makes it
+ * fail instead of raising SIGPIPE.
+ * Returns: SUCCESS or FAIL
+ */
+int writeAll(int fd, char *buf, int len) {
+    while (len > 0) {
+        int n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // the socket is non-blocking: wait until the client drains it
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                return FAIL;
+            continue;
+        }
+        if (n <= 0)
+            return FAIL;
+        buf += n;
+        len -= n;
+    }
+    return SUCCESS;
+}
 
+/*
+ * Sends the replies gathered in a connection's output buffer, once the
+ * commands they answer are in the log.
+ * Returns: SUCCESS or FAIL
+ */
+int flushReplies(connection *conn) {
+    if (conn->out_len > 0)
+        wal_sync();
+    if (conn->out_len > 0 && writeAll(conn->fd, conn->out, conn->out_len) == FAIL) {
+        perror("Server: failed to send");
+        return FAIL;
+    }
+    conn->out_len = 0;
+    return SUCCESS;
+}
 
-    while (1) {
-        addrlen = sizeof(struct sockaddr_un);
-        
-        // Receive command from client
-        if ( (c = recvfrom(sockfd, in_buffer, sizeof(in_buffer)-1, 0,
-	                 (struct sockaddr *) &client_addr, &addrlen)) <= 0 ) {
-            perror("Server: failed to receive");
-            exit(EXIT_FAILURE);
+/*
+ * Makes room for a reply frame in a connection's output buffer, so that
+ * the reply can be built in place.
+ * Input:
+ *  - len: largest size of the reply's payload
+ * Returns: where to write the payload, or NULL if sending failed
+ */
+char *reserveReply(connection *conn, uint32_t len) {
+    if (conn->out_len + FRAME_HEADER_SIZE + len > CONN_BUFFER_SIZE && flushReplies(conn) == FAIL)
+        return NULL;
+    return conn->out + conn->out_len + FRAME_HEADER_SIZE;
+}
+
+/*
+ * Adds the reply built after reserveReply to the output buffer.
+ * Input:
+ *  - len: size of the reply's payload
+ */
+void commitReply(connection *conn, uint32_t len) {
+    memcpy(conn->out + conn->out_len, &len, FRAME_HEADER_SIZE);
+    conn->out_len += FRAME_HEADER_SIZE + len;
+}
+
+/*
+ * Queues a reply frame in a connection's output buffer.
+ * Returns: SUCCESS or FAIL
+ */
+int queueReply(connection *conn, char *payload, uint32_t len) {
+    char *out = reserveReply(conn, len);
+    if (out == NULL)
+        return FAIL;
+
+    memcpy(out, payload, len);
+    commitReply(conn, len);
+    return SUCCESS;
+}
+
+/*
+ * Maps the ring the client passed along with an OP_ATTACH request.
+ * Input:
+ *  - payload: the request frame's payload
+ *  - len: size of the payload
+ *  - reply: filled with the request id and result
+ * Returns: SUCCESS or FAIL (malformed request)
+ */
+int applyAttach(connection *conn, char* payload, uint32_t len, tfs_reply* reply){
+    tfs_request_header header;
+    struct stat st;
+    int fd = conn->passed_fd, seals;
+
+    if (len != sizeof(header))
+        return FAIL;
+    memcpy(&header, payload, sizeof(header));
+    if (header.num_args != 0)
+        return FAIL;
+    reply->request_id = header.request_id;
+    reply->status = TECNICOFS_ERROR_OTHER;
+    conn->passed_fd = -1;
+    if (fd < 0)
+        return SUCCESS;
+
+    // a ring that could shrink would fault the server on access
+    seals = fcntl(fd, F_GET_SEALS);
+    if (conn->shm == NULL && seals >= 0 && (seals & F_SEAL_SHRINK) &&
+        fstat(fd, &st) == 0 && st.st_size == SHM_RING_SIZE) {
+        void *shm = mmap(NULL, SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (shm != MAP_FAILED) {
+            conn->shm = shm;
+            reply->status = SUCCESS;
         }
-        in_buffer[c]='\0';
-    
-        int res = applyCommands(in_buffer);
-    
+    }
+    close(fd);
+    return SUCCESS;
+}
+
+/*
+ * Applies a file command and queues its reply. Written data is used in
+ * place, and read data is copied straight into the output buffer, or
+ * into the shared ring with TFS_IO_SHM.
+ * Input:
+ *  - payload: the request frame's payload
+ *  - len: size of the payload
+ * Returns: SUCCESS or FAIL (malformed request, or sending failed)
+ */
+int applyFile(connection *conn, char* payload, uint32_t len){
+    tfs_io_request req;
+    tfs_reply reply;
+    char *data = payload + sizeof(req), *out = NULL;
+    uint8_t op;
+    int shm;
+
+    if (len < sizeof(req))
+        return FAIL;
+    memcpy(&req, payload, sizeof(req));
+    op = req.header.opcode;
+    shm = req.flags & TFS_IO_SHM;
+    if (op < OP_READ || op > OP_CLOSE || req.header.num_args != 0 || req.length > MAX_IO_SIZE ||
+        (req.flags & ~TFS_IO_SHM) != 0 ||
+        len != sizeof(req) + (!shm && (op == OP_WRITE || op == OP_APPEND) ? req.length : 0))
+        return FAIL;
+
+    if (shm) {
+        if (conn->shm == NULL || req.shm_offset > SHM_RING_SIZE - req.length)
+            return FAIL;
+        data = conn->shm + req.shm_offset;
+    }
+    else if (op == OP_READ) {
+        if ((out = reserveReply(conn, sizeof(reply) + req.length)) == NULL)
+            return FAIL;
+        data = out + sizeof(reply);
+    }
+
+    reply.request_id = req.header.request_id;
+    int inumber = fileDescriptor(conn, req.handle,
+                                 op == OP_READ ? READ : op == OP_CLOSE ? NONE : WRITE);
+    if (inumber < 0)
+        reply.status = inumber;
+    else {
+        switch (op) {
+            case OP_READ:
+                reply.status = read_file(inumber, data, req.length, req.offset);
+                break;
+            case OP_WRITE:
+                reply.status = write_file(inumber, data, req.length, req.offset);
+                break;
+            case OP_APPEND:
+                reply.status = append_file(inumber, data, req.length);
+                break;
+            case OP_TRUNCATE:
+                reply.status = truncate_file(inumber, req.offset);
+                break;
+            default:
+                closeDescriptor(conn, req.handle);
+                reply.status = SUCCESS;
+        }
+    }
+
+    if (out == NULL)
+        return queueReply(conn, (char *) &reply, sizeof(reply));
+    memcpy(out, &reply, sizeof(reply));
+    commitReply(conn, sizeof(reply) + (reply.status > 0 ? reply.status : 0));
+    return SUCCESS;
+}
+
+/*
+ * Applies an OP_MAP_READ request: reads into a new memfd, seals it and
+ * sends it with the reply. Replies gathered so far are sent first, so
+ * the descriptor goes with the right frame.
+ * Input:
+ *  - payload: the request frame's payload
+ *  - len: size of the payload
+ * Returns: SUCCESS or FAIL (malformed request, or sending failed)
+ */
+int applyMapRead(connection *conn, char* payload, uint32_t len){
+    tfs_io_request req;
+    tfs_reply reply;
+    char frame[FRAME_HEADER_SIZE + sizeof(reply)];
+    char control[CMSG_SPACE(sizeof(int))];
+    uint32_t reply_len = sizeof(reply);
+    int fd = -1, inumber;
+    char *map;
+
+    if (len != sizeof(req))
+        return FAIL;
+    memcpy(&req, payload, sizeof(req));
+    if (req.header.num_args != 0 || req.flags != 0 || req.length > MAX_MAP_SIZE)
+        return FAIL;
+    reply.request_id = req.header.request_id;
+
+    if ((reply.status = inumber = fileDescriptor(conn, req.handle, READ)) >= 0 && req.length > 0) {
+        reply.status = TECNICOFS_ERROR_OTHER;
+        if ((fd = memfd_create("tecnicofs-read", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 ||
+            ftruncate(fd, req.length) < 0 ||
+            (map = mmap(NULL, req.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+            perror("Server: failed to create read memfd");
+        else {
+            reply.status = read_file(inumber, map, req.length, req.offset);
+            munmap(map, req.length);
+            // the client gets exactly the bytes read, and no one can change them
+            if (reply.status > 0 && (ftruncate(fd, reply.status) < 0 ||
+                fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)) {
+                perror("Server: failed to seal read memfd");
+                reply.status = TECNICOFS_ERROR_OTHER;
+            }
+        }
+    }
+    else if (inumber >= 0)
+        reply.status = 0;
+
+    if (reply.status <= 0) {
+        if (fd >= 0)
+            close(fd);
+        return queueReply(conn, (char *) &reply, sizeof(reply));
+    }
+
+    memcpy(frame, &reply_len, FRAME_HEADER_SIZE);
+    memcpy(frame + FRAME_HEADER_SIZE, &reply, sizeof(reply));
+    struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    int n;
+    if (flushReplies(conn) == FAIL) {
+        close(fd);
+        return FAIL;
+    }
+    while ((n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // the socket is non-blocking: wait until the client drains it
+            struct pollfd pfd = { .fd = conn->fd, .events = POLLOUT };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                break;
+        }
+        else if (errno != EINTR)
+            break;
+    }
+    close(fd);
+    // the descriptor went with the first byte; the rest is plain data
+    if (n < 0 || writeAll(conn->fd, frame + n, sizeof(frame) - n) == FAIL) {
+        perror("Server: failed to send");
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Applies every complete request in a connection's input buffer and
+ * queues their replies. Incomplete requests are kept for the next read.
+ * Returns: SUCCESS or FAIL (malformed frame)
+ */
+int processFrames(connection *conn) {
+    char command[MAX_FRAME_SIZE + 1], reply[BATCH_REPLY_SIZE];
+    int off = 0;
+
+    while (conn->in_len - off >= FRAME_HEADER_SIZE) {
+        uint32_t len;
+        memcpy(&len, conn->in + off, FRAME_HEADER_SIZE);
+        if (len > MAX_FRAME_SIZE) {
+            fprintf(stderr, "Server: frame too large (%u bytes)\n", len);
+            return FAIL;
+        }
+        if (conn->in_len - off < FRAME_HEADER_SIZE + len)
+            break;
+
+        char *payload = conn->in + off + FRAME_HEADER_SIZE;
+        off += FRAME_HEADER_SIZE + len;
+
+        if (conn->binary) {
+            tfs_reply breply;
+            int reply_len = sizeof(breply);
+            if (len >= 1 && payload[0] >= OP_READ && payload[0] <= OP_CLOSE) {
+                if (applyFile(conn, payload, len) == FAIL) {
+                    fprintf(stderr, "Server: malformed file request\n");
+                    return FAIL;
+                }
+                continue;
+            }
+            if (len >= 1 && payload[0] == OP_MAP_READ) {
+                if (applyMapRead(conn, payload, len) == FAIL) {
+                    fprintf(stderr, "Server: malformed file request\n");
+                    return FAIL;
+                }
+                continue;
+            }
+            if (len >= 1 && payload[0] == OP_BATCH)
+                reply_len = applyBatch(conn, payload, len, reply);
+            else if (len >= 1 && payload[0] == OP_ATTACH) {
+                if (applyAttach(conn, payload, len, &breply) == FAIL)
+                    reply_len = FAIL;
+                else
+                    memcpy(reply, &breply, sizeof(breply));
+            }
+            else if (applyBinary(conn, payload, len, &breply) == FAIL)
+                reply_len = FAIL;
+            else
+                memcpy(reply, &breply, sizeof(breply));
+            if (reply_len == FAIL) {
+                fprintf(stderr, "Server: malformed binary request\n");
+                return FAIL;
+            }
+            if (queueReply(conn, reply, reply_len) == FAIL)
+                return FAIL;
+            continue;
+        }
+
+        memcpy(command, payload, len);
+        command[len] = '\0';
+
+        int res;
+        if (command[0] == TFS_NEGOTIATE_COMMAND) {
+            // the client asks for the binary protocol
+            if (atoi(command + 1) == TFS_PROTOCOL_VERSION) {
+                conn->binary = 1;
+                res = TFS_PROTOCOL_VERSION;
+            }
+            else
+                res = FAIL;
+        }
+        else
+            res = applyCommands(command);
+
         // int to string
-        if ( sprintf(out_buffer, "%d", res) < 0 ) {
+        int reply_len = sprintf(reply, "%d", res);
+        if ( reply_len < 0 ) {
             perror("Server: sprintf fail");
             exit(EXIT_FAILURE);
         }
-    
-        // Send message to client
-        if ( sendto(sockfd, out_buffer, c+1, 0,
-                    (struct sockaddr *) &client_addr, addrlen) <= 0 ) {
-            perror("Server: failed to send");
-            exit(EXIT_FAILURE);
-        }
+        if (queueReply(conn, reply, reply_len) == FAIL)
+            return FAIL;
+    }
+
+    conn->in_len -= off;
+    memmove(conn->in, conn->in + off, conn->in_len);
+    return SUCCESS;
+}
+
+/*
+ * Counts the complete requests in a connection's input buffer.
+ * Returns: number of requests, or FAIL if a frame is malformed
+ */
+int countFrames(connection *conn) {
+    int off = 0, count = 0;
+
+    while (conn->in_len - off >= FRAME_HEADER_SIZE) {
+        uint32_t len;
+        memcpy(&len, conn->in + off, FRAME_HEADER_SIZE);
+        if (len > MAX_FRAME_SIZE)
+            return FAIL;
+        if (conn->in_len - off < FRAME_HEADER_SIZE + len)
+            break;
+        off += FRAME_HEADER_SIZE + len;
+        count++;
+    }
+    return count;
+}
+
+void closeConnection(connection *conn) {
+    for (int fd = 0; fd < MAX_OPEN_FILES; fd++)
+        if (conn->files[fd].inumber != FREE_INODE)
+            closeDescriptor(conn, fd);
+    if (conn->shm != NULL && munmap(conn->shm, SHM_RING_SIZE) < 0)
+        perror("Server: failed to unmap ring");
+    if (conn->passed_fd >= 0)
+        close(conn->passed_fd);
+
+    // closing the fd also removes it from epoll
+    if ( close(conn->fd) < 0 ) {
+        perror("Server: failed to close connection");
+    }
+    free(conn);
+}
+
+/*
+ * Gives the connection back to epoll, to wait for more requests.
+ */
+void rearmConnection(connection *conn) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+
+    if ( epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->fd, &ev) < 0 ) {
+        perror("Server: failed to rearm connection");
+        closeConnection(conn);
+    }
+}
+
+void insertConnection(connection *conn) {
+
+    pthread_mutex_lock(&readyLock);
+    while ( numberReady == MAX_READY )
+        pthread_cond_wait(&canInsert, &readyLock);
+    readyConns[insertPtr] = conn;
+    insertPtr++;
+    if ( insertPtr == MAX_READY )
+        insertPtr = 0;
+    numberReady++;
+    pthread_cond_signal(&canRemove);
+    pthread_mutex_unlock(&readyLock);
+}
+
+connection *removeConnection() {
+    connection *conn;
+
+    pthread_mutex_lock(&readyLock);
+    while ( numberReady == 0 )
+        pthread_cond_wait(&canRemove, &readyLock);
+    conn = readyConns[removePtr];
+    removePtr++;
+    if ( removePtr == MAX_READY )
+        removePtr = 0;
+    numberReady--;
+    pthread_cond_signal(&canInsert);
+    pthread_mutex_unlock(&readyLock);
+    return conn;
+}
+
+/*
+ * Worker: applies the requests of ready connections and sends the replies.
+ */
+void* threadfn(void* arg){
+
+    while (1) {
+        connection *conn = removeConnection();
+
+        if (processFrames(conn) == FAIL || flushReplies(conn) == FAIL || conn->closing)
+            closeConnection(conn);
+        else
+            rearmConnection(conn);
     }
 
     pthread_exit(NULL);
 }
 
-void threadPool_init(pthread_t tid[], int sockfd) {
+/*
+ * Accepts every pending client and registers it in epoll.
+ */
+void acceptClients() {
+    while (1) {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Server: failed to accept");
+            return;
+        }
+
+        connection *conn = malloc(sizeof(connection));
+        if (conn == NULL) {
+            perror("Server: failed to allocate connection");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->closing = 0;
+        conn->binary = 0;
+        for (int i = 0; i < MAX_OPEN_FILES; i++)
+            conn->files[i].inumber = FREE_INODE;
+        conn->passed_fd = -1;
+        conn->shm = NULL;
+        conn->in_len = 0;
+        conn->out_len = 0;
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = conn };
+        if ( epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) < 0 ) {
+            perror("Server: failed to register connection");
+            closeConnection(conn);
+        }
+    }
+}
+
+/*
+ * Takes the descriptors passed along with a message: the first is kept
+ * for OP_ATTACH, replacing any kept before, and the others are closed.
+ * Returns: SUCCESS, or FAIL if some were dropped for lack of room
+ */
+int takePassedFds(connection *conn, struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (i > 0) {
+                close(fd);
+                continue;
+            }
+            if (conn->passed_fd >= 0)
+                close(conn->passed_fd);
+            conn->passed_fd = fd;
+        }
+    }
+    return msg->msg_flags & MSG_CTRUNC ? FAIL : SUCCESS;
+}
+
+/*
+ * Reads what a client sent. Connections with complete requests are handed
+ * to the workers; the others go back to epoll.
+ */
+void readClient(connection *conn) {
+    int frames;
+
+    while (conn->in_len < CONN_BUFFER_SIZE) {
+        // the client may pass a descriptor along with a request (OP_ATTACH)
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { .iov_base = conn->in + conn->in_len,
+                             .iov_len = CONN_BUFFER_SIZE - conn->in_len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = control, .msg_controllen = sizeof(control) };
+        int n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n > 0 && takePassedFds(conn, &msg) == FAIL) {
+            fprintf(stderr, "Server: too many descriptors passed, dropping client\n");
+            closeConnection(conn);
+            return;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            conn->closing = 1;
+            break;
+        }
+        conn->in_len += n;
+    }
+
+    if ( (frames = countFrames(conn)) == FAIL ) {
+        fprintf(stderr, "Server: malformed frame, dropping client\n");
+        closeConnection(conn);
+    }
+    else if (frames > 0)
+        insertConnection(conn);
+    else if (conn->closing)
+        closeConnection(conn);
+    else
+        rearmConnection(conn);
+}
+
+/*
+ * Event loop: the only thread that waits for clients.
+ */
+void eventLoop() {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Server: epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                acceptClients();
+            else
+                readClient(events[i].data.ptr);
+        }
+    }
+}
+
+void threadPool_init(pthread_t tid[]) {
 
     // error check
     if ( numberThreads <= 0 ) {
@@ -156,7 +936,7 @@ void threadPool_init(pthread_t tid[], int sockfd) {
 
     // starts all threads
     for ( int i = 0; i < numberThreads; i++ ) {
-        if ( pthread_create(&tid[i], NULL, threadfn, (void*)&sockfd) != SUCCESS ) {
+        if ( pthread_create(&tid[i], NULL, threadfn, NULL) != SUCCESS ) {
             perror("Error: failed to create a thread");
             exit(EXIT_FAILURE);
         }
@@ -174,24 +954,41 @@ void threadPool_destroy(pthread_t tid[]) {
 
 }
 
+/*
+ * SIGUSR1 handler: has a checkpoint taken now, e.g. before copying the
+ * data directory.
+ */
+void requestCheckpoint(int sig) {
+    checkpoint_request();
+}
+
 int main(int argc, char* argv[]) {
     
-    int sockfd;
     struct sockaddr_un server_addr;
+    struct sigaction sa;
     socklen_t addrlen;
     char* path;
 
 
-    if ( argc != 3 ) {
+    if ( argc != 3 && argc != 4 ) {
         perror("Error: argument count wrong");
         exit(EXIT_FAILURE);
     }
 
-    /* init filesystem */
-    init_fs();
+    /* init filesystem, from the checkpoint and log in the data directory if there is one */
+    init_fs(argc == 4 ? argv[3] : NULL);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = requestCheckpoint;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if ( sigaction(SIGUSR1, &sa, NULL) < 0 ) {
+        perror("Server: sigaction error");
+        exit(EXIT_FAILURE);
+    }
 
     // Create Socket
-    if ((sockfd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("Server: can't open sock");
         exit(EXIT_FAILURE);
     }
@@ -205,18 +1002,33 @@ int main(int argc, char* argv[]) {
     addrlen = setSockAddrUn (path, &server_addr);
 
     // bind
-    if ( bind(sockfd, (struct sockaddr *) &server_addr, addrlen) < 0 ) {
+    if ( bind(listenfd, (struct sockaddr *) &server_addr, addrlen) < 0 ) {
         perror("Server: bind error");
         exit(EXIT_FAILURE);
     }
 
+    if ( listen(listenfd, SOMAXCONN) < 0 ) {
+        perror("Server: listen error");
+        exit(EXIT_FAILURE);
+    }
+
+    // the listening socket is the epoll entry with a NULL pointer
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if ( (epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+         epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev) < 0 ) {
+        perror("Server: epoll error");
+        exit(EXIT_FAILURE);
+    }
+
     if ( (numberThreads = atoi(argv[1])) == 0 ) {
         perror("Error: number of threads is 0");
         exit(EXIT_FAILURE);
     }
     pthread_t tid[numberThreads];
 
-    threadPool_init(tid, sockfd);
+    threadPool_init(tid);
+
+    eventLoop();
     
     threadPool_destroy(tid);
     exit(EXIT_SUCCESS);
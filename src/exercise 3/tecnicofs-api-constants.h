@@ -2,8 +2,14 @@
 #ifndef TECNICOFS_API_CONSTANTS_H
 #define TECNICOFS_API_CONSTANTS_H
 
-#define MAX_FILE_NAME 100
-#define MAX_INPUT_SIZE 100
+/* Size of a file name, with its terminating NUL (names of up to 255 bytes) */
+#define MAX_FILE_NAME 256
+/* Size of a path, with its terminating NUL (PATH_MAX) */
+#define MAX_PATH_SIZE 4096
+/* Size of a command line: a command letter and up to two paths */
+#define MAX_INPUT_SIZE (2 * MAX_PATH_SIZE + 8)
+/* Files a session can have open at once */
+#define MAX_OPEN_FILES 64
 
 
 typedef enum permission { NONE, WRITE, READ, RW } permission;
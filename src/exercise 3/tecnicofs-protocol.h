@@ -0,0 +1,124 @@
+/* tecnicofs-protocol.h */
+#ifndef TECNICOFS_PROTOCOL_H
+#define TECNICOFS_PROTOCOL_H
+
+#include <stdint.h>
+
+/*
+ * Client and server talk over an AF_UNIX SOCK_STREAM connection that
+ * lasts for the whole session. Every request and every reply is a frame:
+ * a 4 byte payload length, in host byte order, followed by the payload.
+ * A client may send many requests before reading their replies; the
+ * server answers them in the order they were sent.
+ */
+#define FRAME_HEADER_SIZE sizeof(uint32_t)
+
+/* Largest amount of file data carried by one request or reply */
+#define MAX_IO_SIZE 65536
+
+/* Largest payload of a frame */
+#define MAX_FRAME_SIZE (MAX_IO_SIZE + 64)
+
+/*
+ * A session starts with text commands ("c a/b f", replies "0").
+ * To switch to the binary protocol, the client sends the text command
+ * "b <version>" as its first request; a server that speaks that version
+ * replies with it and every later frame on the connection is binary.
+ * Any other reply means the session stays in text mode.
+ */
+#define TFS_PROTOCOL_VERSION 1
+#define TFS_NEGOTIATE_COMMAND 'b'
+
+/* Binary request opcodes */
+enum tfs_opcode {
+	OP_CREATE = 1,
+	OP_DELETE,
+	OP_LOOKUP,
+	OP_MOVE,
+	OP_PRINT,
+	OP_BATCH,
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_APPEND,
+	OP_TRUNCATE,
+	OP_CLOSE,
+	OP_ATTACH,
+	OP_MAP_READ
+};
+
+/*
+ * Binary request: this header, then num_args arguments, each a uint16_t
+ * length followed by that many bytes. The length counts a terminating
+ * NUL, which is part of the argument, so the server can use it in place.
+ */
+typedef struct tfs_request_header {
+	uint8_t opcode;
+	uint8_t node_type;   /* 'f' or 'd' for OP_CREATE, the permission for OP_OPEN */
+	uint16_t num_args;
+	uint32_t request_id; /* chosen by the client, echoed in the reply */
+} tfs_request_header;
+
+#define ARG_HEADER_SIZE sizeof(uint16_t)
+
+/* Binary reply */
+typedef struct tfs_reply {
+	uint32_t request_id;
+	int32_t status;
+} tfs_reply;
+
+/*
+ * Batch request: a header with opcode OP_BATCH and num_args set to the
+ * number of requests, then that many requests, each encoded as above
+ * (their request ids are ignored). The server applies them back to back
+ * and answers with one reply whose status is the number of requests,
+ * followed by an int32_t result per request, in order.
+ */
+#define MAX_BATCH_OPS \
+	((MAX_FRAME_SIZE - sizeof(tfs_request_header)) / \
+	 (sizeof(tfs_request_header) + ARG_HEADER_SIZE + 1))
+
+#define BATCH_REPLY_SIZE (sizeof(tfs_reply) + MAX_BATCH_OPS * sizeof(int32_t))
+
+/*
+ * OP_OPEN is a request with the file's path as its argument and the
+ * permission asked for in node_type; the status of the reply is a
+ * descriptor for the file commands below, valid until OP_CLOSE or the
+ * end of the session.
+ * File commands have no arguments: the header is followed by the fields
+ * below and, for OP_WRITE and OP_APPEND, by length bytes of data. The
+ * status of the reply is the number of bytes read or written (SUCCESS
+ * for OP_TRUNCATE and OP_CLOSE) or an error; a read reply is followed by
+ * the bytes.
+ */
+typedef struct tfs_io_request {
+	tfs_request_header header; /* num_args is 0 */
+	int32_t handle;            /* descriptor returned by OP_OPEN */
+	uint32_t length;           /* at most MAX_IO_SIZE */
+	uint64_t offset;           /* ignored by OP_APPEND; new size for OP_TRUNCATE */
+	uint32_t flags;
+	uint32_t shm_offset;       /* with TFS_IO_SHM, where the data is in the ring */
+} tfs_io_request;
+
+/*
+ * Shared memory channel: right after negotiating the binary protocol, a
+ * client may send an OP_ATTACH request (a bare header) together with a
+ * memfd of SHM_RING_SIZE bytes, passed with SCM_RIGHTS and sealed
+ * against shrinking. If the reply's status is SUCCESS, OP_READ, OP_WRITE
+ * and OP_APPEND requests with the TFS_IO_SHM flag carry no data on the
+ * socket: the bytes are at shm_offset in the shared ring, where the
+ * server reads written data in place and stores the bytes it reads. The
+ * client owns the ring and must not reuse a range before its reply.
+ */
+#define SHM_RING_SIZE (64 * MAX_IO_SIZE)
+#define TFS_IO_SHM 1
+
+/*
+ * OP_MAP_READ is a read of up to MAX_MAP_SIZE bytes (flags must be 0)
+ * whose data does not travel on the socket: if the status is positive,
+ * the reply comes with a memfd passed with SCM_RIGHTS, holding exactly
+ * status bytes and sealed against any change, for the client to map.
+ */
+#define MAX_MAP_SIZE (1 << 30)
+
+#endif /* TECNICOFS_PROTOCOL_H */